@@ -0,0 +1,362 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jtag.h"
+#include "dap.h"
+
+// Throughput and latency of the jtag, dap, and fpga layers, on
+// whatever backend jtag_open() picks.  One line per case on stdout,
+// tab separated, under a header line starting with '#':
+//
+//   suite op bytes/op ops/commit ops bytes secs MB/s commits/s
+//   commits implicit tcks usb usb/op wait_ms tck_eff
+//
+// ops/commit is 0 where the layer commits for itself.  tck_eff is
+// payload bits (bytes * 8) over TCK cycles clocked.  usb counts bulk
+// transfers, implicit the transactions sent mid-scan for want of
+// buffer space, and wait_ms the time blocked on USB; all three are 0
+// on backends without USB.
+
+int fpga_send_bitfile(JTAG *jtag, void *data, u32 sz, int warmboot);
+int fpga_prepare_bitfile(u8 *data, u32 sz);
+
+static u32 total = 1024 * 1024;
+
+static u64 NOW(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) return 0;
+	return (((u64) ts.tv_sec) * ((u64)1000000000)) + ((u64) ts.tv_nsec);
+}
+
+static u64 bench_t0;
+
+static void bench_start(JTAG *jtag) {
+	jtag_reset_stats(jtag);
+	bench_t0 = NOW();
+}
+
+static void bench_report(JTAG *jtag, const char *suite, const char *op,
+	u32 opsize, u32 percommit, u32 ops) {
+	JTAG_STATS s;
+	double secs = (NOW() - bench_t0) / 1000000000.0;
+	u64 bytes = ((u64) opsize) * ops;
+	u64 usb;
+
+	jtag_get_stats(jtag, &s);
+	usb = s.usb_out + s.usb_in;
+	if (secs <= 0) {
+		secs = 0.000000001;
+	}
+	printf("%s\t%s\t%u\t%u\t%u\t%llu\t%.6f\t%.3f\t%.1f\t%llu\t%llu\t%llu\t%llu\t%.2f\t%.3f\t%.4f\n",
+		suite, op, opsize, percommit, ops, (unsigned long long) bytes,
+		secs, bytes / secs / 1000000.0, s.commits / secs,
+		(unsigned long long) s.commits, (unsigned long long) s.implicit,
+		(unsigned long long) s.tcks, (unsigned long long) usb,
+		((double) usb) / ops, s.wait_ns / 1000000.0,
+		s.tcks ? (bytes * 8.0) / s.tcks : 0.0);
+	fflush(stdout);
+}
+
+// Raw scans through the BYPASS register of the first device on the
+// chain, so they work with any parts on it.
+static int bench_jtag(JTAG *jtag) {
+	static const u32 BITS[] = { 32, 1024, 32 * 1024, 1024 * 1024 };
+	static const u32 GROUP[] = { 1, 16, 256 };
+	static const char *OPS[] = { "dr_wr", "dr_rd", "dr_io" };
+	JTAG_INFO *info;
+	u8 *wbuf, *rbuf, *w, *r;
+	u32 bypass = 0xFFFFFFFF;
+	u32 n, g, op, i, k, bytes, ops, group;
+
+	if (jtag_enumerate(jtag) <= 0) {
+		fprintf(stderr, "bench: no devices on the chain\n");
+		return -1;
+	}
+	if (jtag_select_device_nth(jtag, 0)) {
+		return -1;
+	}
+	info = jtag_get_nth_device(jtag, 0);
+	jtag_ir_wr(jtag, info->irsize, &bypass);
+	if (jtag_commit(jtag)) {
+		return -1;
+	}
+
+	if ((wbuf = malloc(total)) == NULL) {
+		return -1;
+	}
+	if ((rbuf = malloc(total)) == NULL) {
+		free(wbuf);
+		return -1;
+	}
+	for (n = 0; n < total; n++) {
+		wbuf[n] = n * 7;
+	}
+
+	for (n = 0; n < sizeof(BITS) / sizeof(BITS[0]); n++) {
+		bytes = BITS[n] / 8;
+		ops = total / bytes;
+		if (ops == 0) {
+			continue;
+		}
+		for (g = 0; g < sizeof(GROUP) / sizeof(GROUP[0]); g++) {
+			group = (GROUP[g] > ops) ? ops : GROUP[g];
+			if (g && (group == GROUP[g - 1])) {
+				continue;
+			}
+			for (op = 0; op < 3; op++) {
+				bench_start(jtag);
+				for (i = 0, k = 0; i < ops; i++) {
+					w = wbuf + i * bytes;
+					r = rbuf + i * bytes;
+					switch (op) {
+					case 0: jtag_dr_wr(jtag, BITS[n], w); break;
+					case 1: jtag_dr_rd(jtag, BITS[n], r); break;
+					case 2: jtag_dr_io(jtag, BITS[n], w, r); break;
+					}
+					if ((++k == group) || (i == (ops - 1))) {
+						k = 0;
+						if (jtag_commit(jtag)) {
+							free(wbuf);
+							free(rbuf);
+							return -1;
+						}
+					}
+				}
+				bench_report(jtag, "jtag", OPS[op], bytes, group, ops);
+			}
+		}
+	}
+	free(wbuf);
+	free(rbuf);
+	return 0;
+}
+
+// Memory reads, writes, or pushed-verifies (of what was first written)
+// through AHB-AP 0, at addr.
+#define DAP_READ	0
+#define DAP_WRITE	1
+#define DAP_VERIFY	2
+
+static int bench_dap(JTAG *jtag, u32 addr, int mode) {
+	static const char *OPS[] = { "mem_read", "mem_write", "mem_verify" };
+	static const u32 BLOCK[] = { 4, 64, 1024, 16 * 1024, 64 * 1024 };
+	DAP *dap;
+	u32 *buf;
+	u32 n, i, ops, size;
+	int r = 0;
+
+	if ((dap = dap_init(jtag, 0x4ba00477)) == NULL) {
+		return -1;
+	}
+	if (dap_attach(dap) || ((buf = malloc(BLOCK[4])) == NULL)) {
+		dap_free(dap);
+		return -1;
+	}
+	dap_calibrate(dap, 0, addr);
+	for (n = 0; n < BLOCK[4] / 4; n++) {
+		buf[n] = n * 0x01010101;
+	}
+	if ((mode == DAP_VERIFY) && dap_mem_write(dap, 0, addr, buf, BLOCK[4])) {
+		fprintf(stderr, "bench: dap transfer failed\n");
+		free(buf);
+		dap_free(dap);
+		return -1;
+	}
+	for (n = 0; (n < sizeof(BLOCK) / sizeof(BLOCK[0])) && (r == 0); n++) {
+		size = BLOCK[n];
+		if ((ops = total / size) == 0) {
+			continue;
+		}
+		bench_start(jtag);
+		for (i = 0; i < ops; i++) {
+			// walk through one block's worth of target memory
+			u32 a = addr + ((i * size) % BLOCK[4]);
+			switch (mode) {
+			case DAP_READ:
+				r = dap_mem_read(dap, 0, a, buf, size);
+				break;
+			case DAP_WRITE:
+				r = dap_mem_write(dap, 0, a, buf, size);
+				break;
+			default:
+				r = dap_mem_verify(dap, 0, a, ((u8*) buf) + (a - addr), size);
+			}
+			if (r) {
+				fprintf(stderr, "bench: dap transfer failed\n");
+				break;
+			}
+		}
+		if (r == 0) {
+			bench_report(jtag, "dap", OPS[mode], size, 0, ops);
+		}
+	}
+	free(buf);
+	dap_free(dap);
+	return r;
+}
+
+// Stand-in bitstream: sync, NOPs, desync.  Harmless to a configured
+// part, and it goes through CFG_IN just as a real one would.
+static u8 *fake_bitfile(u32 sz) {
+	u32 n, w;
+	u8 *data;
+	if ((data = malloc(sz)) == NULL) {
+		return NULL;
+	}
+	for (n = 0; n < sz; n += 4) {
+		if (n < 32) {
+			w = 0xFFFFFFFF;
+		} else if (n == 32) {
+			w = 0xAA995566;
+		} else if (n == (sz - 8)) {
+			w = 0x30008001; // write CMD
+		} else if (n == (sz - 4)) {
+			w = 0x0000000D; // DESYNC
+		} else {
+			w = 0x20000000;
+		}
+		data[n] = w >> 24;
+		data[n + 1] = w >> 16;
+		data[n + 2] = w >> 8;
+		data[n + 3] = w;
+	}
+	fpga_prepare_bitfile(data, sz);
+	return data;
+}
+
+static int bench_fpga(JTAG *jtag, const char *fn) {
+	static const u32 SIZE[] = { 64 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	FILE *fp;
+	u8 *data;
+	u32 n, sz;
+
+	if (fn) {
+		if ((fp = fopen(fn, "rb")) == NULL) {
+			fprintf(stderr, "bench: cannot open '%s'\n", fn);
+			return -1;
+		}
+		fseek(fp, 0, SEEK_END);
+		sz = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		if ((data = malloc(sz)) == NULL) {
+			fclose(fp);
+			return -1;
+		}
+		if (fread(data, sz, 1, fp) != 1) {
+			fprintf(stderr, "bench: cannot read '%s'\n", fn);
+			fclose(fp);
+			free(data);
+			return -1;
+		}
+		fclose(fp);
+		fpga_prepare_bitfile(data, sz);
+		bench_start(jtag);
+		if (fpga_send_bitfile(jtag, data, sz, 0)) {
+			free(data);
+			return -1;
+		}
+		bench_report(jtag, "fpga", "send_bitfile", sz, 0, 1);
+		free(data);
+		return 0;
+	}
+	for (n = 0; n < sizeof(SIZE) / sizeof(SIZE[0]); n++) {
+		if ((data = fake_bitfile(SIZE[n])) == NULL) {
+			return -1;
+		}
+		bench_start(jtag);
+		if (fpga_send_bitfile(jtag, data, SIZE[n], 0)) {
+			free(data);
+			return -1;
+		}
+		bench_report(jtag, "fpga", "send_bitfile", SIZE[n], 0, 1);
+		free(data);
+	}
+	return 0;
+}
+
+static int usage(void) {
+	fprintf(stderr,
+"usage: bench [ -n <bytes> ] [ -a <addr> ] [ -b <bitfile> ] <suite>...\n"
+"\n"
+"  jtag       dr scans through BYPASS, by scan size and scans per commit\n"
+"  dap-read   AHB-AP memory reads at addr (default 0), by block size\n"
+"  dap-write  AHB-AP memory writes at addr (overwrites 64K there)\n"
+"  dap-verify AHB-AP pushed-verify of memory at addr (also overwrites)\n"
+"  fpga       7-series download of bitfile, or of NOP-filled stand-ins\n"
+"\n"
+"  -n sets the bytes moved by each case (default 1M)\n"
+		);
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	const char *bitfile = NULL;
+	u32 addr = 0;
+	JTAG *jtag;
+	int n, r = 0;
+
+	while ((argc > 1) && (argv[1][0] == '-')) {
+		if (argc < 3) {
+			return usage();
+		}
+		if (!strcmp(argv[1], "-n")) {
+			total = strtoul(argv[2], 0, 0);
+		} else if (!strcmp(argv[1], "-a")) {
+			addr = strtoul(argv[2], 0, 0);
+		} else if (!strcmp(argv[1], "-b")) {
+			bitfile = argv[2];
+		} else {
+			return usage();
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 2) {
+		return usage();
+	}
+	for (n = 1; n < argc; n++) {
+		if (strcmp(argv[n], "jtag") && strcmp(argv[n], "dap-read") &&
+			strcmp(argv[n], "dap-write") && strcmp(argv[n], "dap-verify") &&
+			strcmp(argv[n], "fpga")) {
+			return usage();
+		}
+	}
+
+	if (jtag_open(&jtag)) {
+		fprintf(stderr, "bench: cannot open jtag\n");
+		return -1;
+	}
+	printf("# suite\top\tbytes/op\tops/commit\tops\tbytes\tsecs\tMB/s\tcommits/s"
+		"\tcommits\timplicit\ttcks\tusb\tusb/op\twait_ms\ttck_eff\n");
+	for (n = 1; (n < argc) && (r == 0); n++) {
+		if (!strcmp(argv[n], "jtag")) {
+			r = bench_jtag(jtag);
+		} else if (!strcmp(argv[n], "dap-read")) {
+			r = bench_dap(jtag, addr, DAP_READ);
+		} else if (!strcmp(argv[n], "dap-write")) {
+			r = bench_dap(jtag, addr, DAP_WRITE);
+		} else if (!strcmp(argv[n], "dap-verify")) {
+			r = bench_dap(jtag, addr, DAP_VERIFY);
+		} else {
+			r = bench_fpga(jtag, bitfile);
+		}
+	}
+	jtag_close(jtag);
+	return r;
+}
@@ -28,7 +28,7 @@ int main(int argc, char **argv) {
 	unsigned n;
 	u32 x;
 
-	if (jtag_mpsse_open(&jtag)) return -1;
+	if (jtag_open(&jtag)) return -1;
 
 	dap = dap_init(jtag, 0x4ba00477);
 	if (dap_attach(dap))
@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "dap.h"
 #include "dap-registers.h"
@@ -29,12 +30,65 @@ static u64 NOW(void) {
 	return (((u64) ts.tv_sec) * ((u64)1000000000)) + ((u64) ts.tv_nsec);
 }
 
+// what is known of an AP's CSW and TAR
+#define AP_CSW_VALID	1
+#define AP_TAR_VALID	2
+
+// what an AP's CSW was found to accept (see dap_ap_caps())
+#define AP_CAP_PROBED	1
+#define AP_CAP_SIZE8	2
+#define AP_CAP_SIZE16	4
+#define AP_CAP_PACKED	8
+
+typedef struct {
+	u32 valid;
+	u32 csw;
+	u32 tar;
+	u32 caps;
+} DAPAP;
+
 struct DAP {
 	JTAG *jtag;
 	u32 device_id;
 	u32 cached_ir;
+	// TCKs to idle after each AP memory access, so it can complete
+	// before the next scan captures its ack; raised on WAIT
+	u32 idle;
+
+	// DP SELECT, and each AP's CSW and TAR, as last written (TAR
+	// tracking auto-increment), so rewriting them can be skipped.
+	// Forgotten on abort or error, since writes may have been lost.
+	u32 cached_select;
+	u32 select_valid;
+	DAPAP ap[256];
+
+	// TRNMODE and MASKLANE of DP CTRL/STAT as last written
+	u32 trnmode;
+
+	// components found in the ROM tables (see dap_discover())
+	DAPCOMP comp[DAP_COMP_MAX];
+	u32 ncomp;
+	u32 discovered;
+
+	// while set, scans queued without a place for their capture
+	// land here in turn instead (see dap_batch_run())
+	u64 *capture;
+	u32 captured;
+
+	// what dap_get_stats() reports
+	DAP_STATS stats;
 };
 
+static void dap_cache_flush(DAP *dap) {
+	u32 n;
+	dap->cached_ir = 0xFFFFFFFF;
+	dap->select_valid = 0;
+	dap->trnmode = 0xFFFFFFFF;
+	for (n = 0; n < 256; n++) {
+		dap->ap[n].valid = 0;
+	}
+}
+
 static void q_dap_ir_wr(DAP *dap, u32 ir) {
 	if (dap->cached_ir != ir) {
 		dap->cached_ir = ir;
@@ -42,14 +96,10 @@ static void q_dap_ir_wr(DAP *dap, u32 ir) {
 	}
 }
 
-// force ir write even if redundant
-// used for a timing hack
-static void _q_dap_ir_wr(DAP *dap, u32 ir) {
-	dap->cached_ir = ir;
-	jtag_ir_wr(dap->jtag, 4, &ir);
-}
-
 static void q_dap_dr_io(DAP *dap, u32 bitcount, u64 wdata, u64 *rdata) {
+	if ((rdata == NULL) && dap->capture) {
+		rdata = dap->capture + dap->captured++;
+	}
 	if (rdata) {
 		*rdata = 0;
 		jtag_dr_io(dap->jtag, bitcount, &wdata, rdata);
@@ -58,6 +108,13 @@ static void q_dap_dr_io(DAP *dap, u32 bitcount, u64 wdata, u64 *rdata) {
 	}
 }
 
+// give the AP access just queued time to complete
+static void q_dap_ap_idle(DAP *dap) {
+	if (dap->idle) {
+		jtag_idle(dap->jtag, dap->idle);
+	}
+}
+
 static void q_dap_abort(DAP *dap) {
 	u32 x;
 	u64 u;
@@ -65,19 +122,21 @@ static void q_dap_abort(DAP *dap) {
 	u = 8;
 	jtag_ir_wr(dap->jtag, 4, &x);
 	jtag_dr_wr(dap->jtag, 35, &u);
-	dap->cached_ir = 0xFFFFFFFF;
+	dap_cache_flush(dap);
 }
 
-// queue a DPCSW status query, commit jtag txn
-static int dap_commit(DAP *dap) {
-	u64 a, b;
+// queue a DPCSW status query, results land in status[0..1]
+static void q_dap_status(DAP *dap, u64 *status) {
 	q_dap_ir_wr(dap, DAP_IR_DPACC);
-	q_dap_dr_io(dap, 35, XPACC_RD(DPACC_CSW), &a);
-	q_dap_dr_io(dap, 35, XPACC_RD(DPACC_RDBUFF), &b);
+	q_dap_dr_io(dap, 35, XPACC_RD(DPACC_CSW), status);
+	q_dap_dr_io(dap, 35, XPACC_RD(DPACC_RDBUFF), status + 1);
 	dap->cached_ir = 0xFFFFFFFF;
-	if (jtag_commit(dap->jtag)) {
-		return -1;
-	}
+}
+
+// check the results of a completed status query
+static int dap_check_status(u64 *status) {
+	u64 a = status[0];
+	u64 b = status[1];
 	if (XPACC_STATUS(a) != XPACC_OK) {
 		fprintf(stderr, "dap: invalid txn status\n");
 		return -1;
@@ -98,15 +157,36 @@ static int dap_commit(DAP *dap) {
 	return 0;
 }
 
+// queue a DPCSW status query, commit jtag txn
+static int dap_commit(DAP *dap) {
+	u64 status[2];
+	q_dap_status(dap, status);
+	if (jtag_commit(dap->jtag) || dap_check_status(status)) {
+		dap_cache_flush(dap);
+		return -1;
+	}
+	return 0;
+}
+
+// Block transfers go out in groups of up to DAP_GROUP blocks, each
+// group one submit with one status check at its end, and keep
+// DAP_INFLIGHT groups in flight: group N+1 is queued while the
+// results of group N are still coming back.
+#define DAP_INFLIGHT	2
+#define DAP_GROUP	8
+
+// Idle TCKs after each AP memory access to start with, and the most
+// a run of WAITs may raise it to.
+#define DAP_IDLE_DEFAULT	8
+#define DAP_IDLE_MAX		1024
+
 int dap_dp_rd(DAP *dap, u32 addr, u32 *val) {
 	u64 u;
 	q_dap_ir_wr(dap, DAP_IR_DPACC);
 	q_dap_dr_io(dap, 35, XPACC_RD(addr), NULL);
 	q_dap_dr_io(dap, 35, XPACC_RD(DPACC_RDBUFF), &u);
-	if (jtag_commit(dap->jtag)) {
-		return -1;
-	}
-	if (XPACC_STATUS(u) != XPACC_OK) {
+	if (jtag_commit(dap->jtag) || (XPACC_STATUS(u) != XPACC_OK)) {
+		dap_cache_flush(dap);
 		return -1;
 	}
 	*val = u >> 3;
@@ -114,22 +194,86 @@ int dap_dp_rd(DAP *dap, u32 addr, u32 *val) {
 }
 
 static void q_dap_dp_wr(DAP *dap, u32 addr, u32 val) {
+	if (addr == DPACC_CSW) {
+		dap->trnmode = val & (DPCSW_MASKLANE(0xF) | (3 << 2));
+	}
 	q_dap_ir_wr(dap, DAP_IR_DPACC);
 	q_dap_dr_io(dap, 35, XPACC_WR(addr, val), NULL);
 	//q_dap_dr_io(dap, 35, XPACC_RD(DPACC_RDBUFF), &s->u);
 }
 
 int dap_dp_wr(DAP *dap, u32 addr, u32 val) {
+	if (addr == DPACC_SELECT) {
+		dap->cached_select = val;
+		dap->select_valid = 1;
+	}
 	q_dap_dp_wr(dap, addr, val);
-	return jtag_commit(dap->jtag);
+	if (jtag_commit(dap->jtag)) {
+		dap_cache_flush(dap);
+		return -1;
+	}
+	return 0;
 }
 
-int dap_ap_rd(DAP *dap, u32 apnum, u32 addr, u32 *val) {
-	u64 u;
-	q_dap_ir_wr(dap, DAP_IR_DPACC);
-	q_dap_dp_wr(dap, DPACC_SELECT, DPSEL_APSEL(apnum) | DPSEL_APBANKSEL(addr));
+// Set the DP transfer mode: TRNMODE and MASKLANE bits of CTRL/STAT.
+// The sticky bits are left alone.
+static void q_dap_trnmode(DAP *dap, u32 mode) {
+	if (dap->trnmode != mode) {
+		q_dap_dp_wr(dap, DPACC_CSW, CSW_ENABLES | mode);
+	}
+}
+
+static void q_dap_select(DAP *dap, u32 apnum, u32 addr) {
+	u32 sel = DPSEL_APSEL(apnum) | DPSEL_APBANKSEL(addr);
+	if (!dap->select_valid || (dap->cached_select != sel)) {
+		q_dap_dp_wr(dap, DPACC_SELECT, sel);
+		dap->cached_select = sel;
+		dap->select_valid = 1;
+	}
+}
+
+// After a DRW access: TAR moves on by the access size with
+// INCR_SINGLE, or by 4 with INCR_PACKED, but is only promised to
+// within a 1K block.
+static void dap_ap_drw(DAP *dap, u32 apnum) {
+	DAPAP *ap = dap->ap + apnum;
+	u32 tar = ap->tar;
+	if (!(ap->valid & AP_CSW_VALID) || ((ap->csw & 7) > APCSW_SIZE32)) {
+		ap->valid &= ~AP_TAR_VALID;
+		return;
+	}
+	switch (ap->csw & (3 << 4)) {
+	case APCSW_INCR_NONE:
+		return;
+	case APCSW_INCR_SINGLE:
+		ap->tar += 1 << (ap->csw & 7);
+		break;
+	case APCSW_INCR_PACKED:
+		ap->tar += 4;
+		break;
+	default:
+		ap->valid &= ~AP_TAR_VALID;
+		return;
+	}
+	if ((ap->tar ^ tar) & ~0x3FF) {
+		ap->valid &= ~AP_TAR_VALID;
+	}
+}
+
+// queue an AP read, its data is captured by the next scan
+static void q_dap_ap_rd(DAP *dap, u32 apnum, u32 addr) {
+	q_dap_select(dap, apnum, addr);
 	q_dap_ir_wr(dap, DAP_IR_APACC);
 	q_dap_dr_io(dap, 35, XPACC_RD(addr), NULL);
+	q_dap_ap_idle(dap);
+	if (addr == APACC_DRW) {
+		dap_ap_drw(dap, apnum);
+	}
+}
+
+int dap_ap_rd(DAP *dap, u32 apnum, u32 addr, u32 *val) {
+	u64 u;
+	q_dap_ap_rd(dap, apnum, addr);
 	q_dap_ir_wr(dap, DAP_IR_DPACC);
 	q_dap_dr_io(dap, 35, XPACC_RD(DPACC_RDBUFF), &u);
 	// TODO: redundant ir wr
@@ -141,118 +285,1084 @@ int dap_ap_rd(DAP *dap, u32 apnum, u32 addr, u32 *val) {
 }
 
 void q_dap_ap_wr(DAP *dap, u32 apnum, u32 addr, u32 val) {
-	q_dap_ir_wr(dap, DAP_IR_DPACC);
-	q_dap_dp_wr(dap, DPACC_SELECT, DPSEL_APSEL(apnum) | DPSEL_APBANKSEL(addr));
+	DAPAP *ap = dap->ap + apnum;
+	switch (addr) {
+	case APACC_CSW:
+		if ((ap->valid & AP_CSW_VALID) && (ap->csw == val)) {
+			return;
+		}
+		ap->csw = val;
+		ap->valid |= AP_CSW_VALID;
+		break;
+	case APACC_TAR:
+		if ((ap->valid & AP_TAR_VALID) && (ap->tar == val)) {
+			return;
+		}
+		ap->tar = val;
+		ap->valid |= AP_TAR_VALID;
+		break;
+	}
+	q_dap_select(dap, apnum, addr);
 	q_dap_ir_wr(dap, DAP_IR_APACC);
 	q_dap_dr_io(dap, 35, XPACC_WR(addr, val), NULL);
+	q_dap_ap_idle(dap);
+	if (addr == APACC_DRW) {
+		dap_ap_drw(dap, apnum);
+	}
 }
 
+// Single words use the same CSW as blocks, so the two never have to
+// rewrite it, and a run of words needs no TAR writes.
+#define DAP_MEM_CSW	(APCSW_DBGSWEN | APCSW_INCR_SINGLE | APCSW_SIZE32)
+
+// Single words go as a batch of one, which sees an access that
+// waited through rather than failing, or doing it twice.
 int dap_mem_wr32(DAP *dap, u32 n, u32 addr, u32 val) {
-	if (addr & 3)
-		return -1;
-	q_dap_ap_wr(dap, n, APACC_CSW,
-		APCSW_DBGSWEN | APCSW_INCR_NONE | APCSW_SIZE32);
-	q_dap_ap_wr(dap, n, APACC_TAR, addr);
-	q_dap_ap_wr(dap, n, APACC_DRW, val);
-	return dap_commit(dap);
+	DAPOP op = { .apnum = n, .addr = addr, .write = 1, .val = val };
+	return dap_mem_batch(dap, &op, 1);
 }
 
 int dap_mem_rd32(DAP *dap, u32 n, u32 addr, u32 *val) {
-	if (addr & 3)
-		return -1;
-	q_dap_ap_wr(dap, n, APACC_TAR, addr);
-	if (dap_ap_rd(dap, n, APACC_DRW, val))
+	DAPOP op = { .apnum = n, .addr = addr, .write = 0 };
+	if (dap_mem_batch(dap, &op, 1))
 		return -1;
+	*val = op.val;
 	return 0;
 }
 
-int dap_mem_read(DAP *dap, u32 apnum, u32 addr, void *data, u32 len) {
-	u64 scratch[1024];
-	u32 *x = data;
+// One block of a transfer: count DRW accesses with CSW csw, from
+// TAR addr, each moving step bytes (4 if packed).  A block stays
+// within 1K, as TAR auto-increment may not cross that.  verify makes
+// its writes pushed-verify ones, which read and compare instead.
+typedef struct {
+	u32 addr;
+	u32 csw;
+	u32 step;
+	u32 count;
+	u32 verify;
+} DAPBLOCK;
+
+// what dap_mem_xfer() does with the data
+#define XFER_READ	0
+#define XFER_WRITE	1
+#define XFER_VERIFY	2
+
+#define DAP_BLOCK_MAX	256
+
+// The byte at address a travels in DRW byte lane a & 3, whatever the
+// access size.
+static u32 dap_lanes_pack(u32 addr, const u8 *data, u32 count) {
+	u32 n, val = 0;
+	for (n = 0; n < count; n++) {
+		val |= ((u32) data[n]) << (8 * ((addr + n) & 3));
+	}
+	return val;
+}
+
+// Queue the accesses of one block, reads if wdata is NULL, else
+// writes of the bytes from wdata on.  Each scan captures the ack of
+// the access before it: scratch[0] is that of whatever preceded the
+// TAR write (OK if TAR needed no write), scratch[1] that of the TAR
+// write or whatever preceded access 0, and scratch[n + 2] that of
+// access n, with its data for a read.  The scan that picks up the
+// last ack is the TAR write for next, if that is to follow with the
+// same CSW, so back to back blocks need no scans between them.
+//
+// TRNMODE applies to every AP write, so a verify block sets up CSW
+// and TAR in the normal mode, then compares just the byte lanes its
+// DRW accesses use.
+static void q_dap_mem_block(DAP *dap, u32 apnum, DAPBLOCK *b, u8 *wdata,
+	u64 *scratch, DAPBLOCK *next) {
+	DAPAP *ap = dap->ap + apnum;
+	// a packed access is a bus transfer per item it carries
+	u32 idle = dap->idle * (b->step >> (b->csw & 7));
+	u32 n, x;
+	if (b->verify) {
+		q_dap_trnmode(dap, DPCSW_TRNMODE_NORMAL);
+	}
+	if (!(ap->valid & AP_CSW_VALID) || (ap->csw != b->csw)) {
+		// if an access before faulted, leaving TAR short, one of
+		// another size could round down to below this block
+		ap->valid &= ~AP_TAR_VALID;
+	}
+	q_dap_ap_wr(dap, apnum, APACC_CSW, b->csw);
+	q_dap_select(dap, apnum, APACC_TAR);
+	q_dap_ir_wr(dap, DAP_IR_APACC);
+	if ((ap->valid & AP_TAR_VALID) && (ap->tar == b->addr)) {
+		scratch[0] = XPACC_OK;
+	} else {
+		q_dap_dr_io(dap, 35, XPACC_WR(APACC_TAR, b->addr), &scratch[0]);
+		q_dap_ap_idle(dap);
+	}
+	if (b->verify) {
+		n = (b->step == 4) ? 0xF : ((((1 << b->step) - 1) << (b->addr & 3)) & 0xF);
+		q_dap_trnmode(dap, DPCSW_TRNMODE_PUSH_VRFY | DPCSW_MASKLANE(n));
+		q_dap_ir_wr(dap, DAP_IR_APACC);
+	}
+	for (n = 0, x = b->addr; n < b->count; n++, x += b->step) {
+		q_dap_dr_io(dap, 35, wdata ? XPACC_WR(APACC_DRW,
+			dap_lanes_pack(x, wdata + n * b->step, b->step)) :
+			XPACC_RD(APACC_DRW), &scratch[n + 1]);
+		if (idle) {
+			jtag_idle(dap->jtag, idle);
+		}
+	}
+	if (next && (next->csw == b->csw) && !b->verify) {
+		q_dap_dr_io(dap, 35, XPACC_WR(APACC_TAR, next->addr), &scratch[n + 1]);
+		q_dap_ap_idle(dap);
+		ap->tar = next->addr;
+		ap->valid |= AP_TAR_VALID;
+		return;
+	}
+	// reading TAR picks up the last ack without leaving APACC
+	q_dap_dr_io(dap, 35, XPACC_RD(APACC_TAR), &scratch[n + 1]);
+	q_dap_ap_idle(dap);
+	ap->tar = x;
+	ap->valid |= AP_TAR_VALID;
+	if ((ap->tar & 0x3FF) == 0) {
+		ap->valid &= ~AP_TAR_VALID;
+	}
+}
+
+// Accesses that completed before the first WAIT.  With ORUNDETECT
+// set, that WAIT also raised STICKYORUN, and the DP has dropped every
+// AP access since, so none of the rest happened.
+static u32 dap_block_done(u64 *scratch, u32 count) {
 	u32 n;
+	for (n = 0; n < (count + 2); n++) {
+		if (XPACC_STATUS(scratch[n]) != XPACC_OK) {
+			return (n > 2) ? (n - 2) : 0;
+		}
+	}
+	return count;
+}
+
+// Clear the overrun left by a WAIT.
+static int dap_clear_overrun(DAP *dap) {
+	q_dap_abort(dap);
+	return dap_dp_wr(dap, DPACC_CSW, CSW_ERRORS | CSW_ENABLES);
+}
+
+// Allow more time per access after a WAIT.
+static int dap_idle_raise(DAP *dap) {
+	if (dap->idle >= DAP_IDLE_MAX) {
+		fprintf(stderr, "dap: AP still waiting after %u idle TCKs\n", dap->idle);
+		return -1;
+	}
+	dap->idle = (dap->idle * 2) + 1;
+	if (dap->idle > DAP_IDLE_MAX) {
+		dap->idle = DAP_IDLE_MAX;
+	}
+	return 0;
+}
+
+// Clear the overrun left by a WAIT and allow more time per access.
+static int dap_mem_wait_recover(DAP *dap) {
+	if (dap_idle_raise(dap)) {
+		return -1;
+	}
+	return dap_clear_overrun(dap);
+}
+
+// Block transfers that fail other than by a WAIT (a sticky error, a
+// status that does not come back, a failed commit) redo the group
+// that failed, after dap_recover(), up to DAP_RETRY_MAX times running.
+#define DAP_RETRY_MAX	4
+#define DAP_RETRY_MS	1
+
+// Abort whatever the AP is doing, clear the sticky bits, and check
+// that the DP is clean and powered up again.  SELECT, CSW, and TAR
+// are forgotten, so whatever comes next writes them afresh.  Try n
+// of the same accesses first backs off DAP_RETRY_MS << (n - 1) ms.
+static int dap_recover(DAP *dap, u32 n) {
+	u32 x;
+	if (n > 0) {
+		usleep((DAP_RETRY_MS * 1000) << (n - 1));
+	}
+	q_dap_abort(dap);
+	if (dap_dp_wr(dap, DPACC_CSW, CSW_ERRORS | CSW_ENABLES) ||
+		dap_dp_rd(dap, DPACC_CSW, &x) || (x & CSW_ERRORS) ||
+		!(x & DPCSW_CSYSPWRUPACK) || !(x & DPCSW_CDBGPWRUPACK)) {
+		return -1;
+	}
+	dap->stats.recoveries++;
+	return 0;
+}
+
+void dap_get_stats(DAP *dap, DAP_STATS *stats) {
+	*stats = dap->stats;
+}
 
-	if ((addr & 3) || (((u64) data) & 3)) {
-		// base and length must be aligned
+// What the AP's CSW takes of SIZE8, SIZE16 and INCR_PACKED, found
+// by writing them and reading back, once per AP.
+static int dap_ap_caps(DAP *dap, u32 apnum) {
+	DAPAP *ap = dap->ap + apnum;
+	u32 caps = AP_CAP_PROBED;
+	u32 x;
+	if (ap->caps & AP_CAP_PROBED) {
+		return ap->caps;
+	}
+	q_dap_ap_wr(dap, apnum, APACC_CSW, APCSW_DBGSWEN | APCSW_INCR_PACKED | APCSW_SIZE8);
+	if (dap_ap_rd(dap, apnum, APACC_CSW, &x)) {
 		return -1;
 	}
+	if ((x & 7) == APCSW_SIZE8) {
+		caps |= AP_CAP_SIZE8;
+	}
+	if ((x & (3 << 4)) == APCSW_INCR_PACKED) {
+		caps |= AP_CAP_PACKED;
+	}
+	q_dap_ap_wr(dap, apnum, APACC_CSW, APCSW_DBGSWEN | APCSW_INCR_SINGLE | APCSW_SIZE16);
+	if (dap_ap_rd(dap, apnum, APACC_CSW, &x)) {
+		return -1;
+	}
+	if ((x & 7) == APCSW_SIZE16) {
+		caps |= AP_CAP_SIZE16;
+	}
+	// what was written is not what the AP holds
+	ap->valid &= ~AP_CSW_VALID;
+	ap->caps = caps;
+	return caps;
+}
 
-	while (len > 0) {
-		// max transfer is 1K
-		// transfer may not cross 1K boundary
-		u32 xfer = 1024 - (addr & 0x3FF);
-		if (xfer > len) {
-			xfer = len;
+// Plan the block for the next len bytes at addr.  size is the bus
+// access size the caller asked for, or 0 for any: then reads cover
+// whole words, trimmed on the way back, and writes use bytes and
+// halfwords only up to the first word boundary and after the last.
+static void dap_mem_plan(u32 caps, u32 addr, u32 len, u32 size, int mode,
+	DAPBLOCK *b) {
+	int write = (mode != XFER_READ);
+	u32 sz = 4;
+	u32 room;
+	b->addr = addr;
+	b->verify = (mode == XFER_VERIFY);
+	if (!write && !size) {
+		b->addr = addr & ~3;
+		len += addr & 3;
+		len = (len > 1024) ? 1024 : ((len + 3) & ~3);
+	} else if ((addr & 3) || (len < 4)) {
+		// up to the next word boundary, a lane at a time
+		if (size) {
+			sz = size;
+		} else {
+			sz = ((addr & 1) || (len == 1) || !(caps & AP_CAP_SIZE16)) ? 1 : 2;
 		}
-		q_dap_ap_wr(dap, apnum, APACC_CSW,
-			APCSW_DBGSWEN | APCSW_INCR_SINGLE | APCSW_SIZE32);
-		q_dap_dr_io(dap, 35, XPACC_WR(APACC_TAR, addr), NULL);
-		// read txn will be returned on the next txn
-		q_dap_dr_io(dap, 35, XPACC_RD(APACC_DRW), NULL);
-		_q_dap_ir_wr(dap, DAP_IR_APACC); // HACK, timing
-		for (n = 0; n < (xfer-4); n += 4) {
-			q_dap_dr_io(dap, 35, XPACC_RD(APACC_DRW), &scratch[n/4]);
-			_q_dap_ir_wr(dap, DAP_IR_APACC); // HACK, timing
+		if (len > (4 - (addr & 3))) {
+			len = 4 - (addr & 3);
 		}
-		// dummy read of TAR to pick up last read value
-		q_dap_dr_io(dap, 35, XPACC_RD(APACC_TAR), &scratch[n/4]);
-		if (dap_commit(dap)) {
+		len = size ? len : sz;
+	} else if (size && (size < 4)) {
+		sz = size;
+		len = (caps & AP_CAP_PACKED) ? (len & ~3) : len;
+	} else {
+		len &= ~3;
+	}
+	b->csw = APCSW_DBGSWEN | (sz >> 1);
+	b->step = sz;
+	if ((sz < 4) && (caps & AP_CAP_PACKED) && !(addr & 3) && (len >= 4)) {
+		b->csw |= APCSW_INCR_PACKED;
+		b->step = 4;
+	} else {
+		b->csw |= APCSW_INCR_SINGLE;
+	}
+	room = 1024 - (b->addr & 0x3FF);
+	if (len > room) {
+		len = room;
+	}
+	b->count = len / b->step;
+	if (b->count > DAP_BLOCK_MAX) {
+		b->count = DAP_BLOCK_MAX;
+	}
+}
+
+// After a failed verify, find and report the first byte that differs
+// in the len bytes at addr.
+static void dap_verify_report(DAP *dap, u32 apnum, u32 addr, u8 *data, u32 len) {
+	u8 *buf;
+	u32 n;
+	if (((buf = malloc(len)) == NULL) ||
+		dap_mem_read(dap, apnum, addr, buf, len)) {
+		fprintf(stderr, "dap: verify failed in %08x..%08x\n", addr, addr + len - 1);
+		free(buf);
+		return;
+	}
+	for (n = 0; n < len; n++) {
+		if (buf[n] != data[n]) {
+			fprintf(stderr, "dap: verify failed at %08x (expected %02x, found %02x)\n",
+				addr + n, data[n], buf[n]);
+			break;
+		}
+	}
+	if (n == len) {
+		fprintf(stderr, "dap: verify failed in %08x..%08x, now matches\n",
+			addr, addr + len - 1);
+	}
+	free(buf);
+}
+
+// Block transfers of any alignment and length, as in mode; see
+// dap_mem_plan().  Blocks are grouped and pipelined as in DAP_GROUP.
+// If an access WAITs, the groups behind it drain, and the transfer
+// picks up again at that access with more idle TCKs.  If a group
+// fails otherwise, they drain the same way, and the transfer picks up
+// again at the start of that group, once dap_recover() has the DAP
+// back, a block at a time until one gets through (see DAP_RETRY_MAX).
+// A verify checks STICKYCMP with each
+// group's status, and stops at the first group that fails.
+#define REDO_WAIT	1
+#define REDO_ERROR	2
+
+static int dap_mem_xfer(DAP *dap, u32 apnum, u32 addr, u8 *data, u32 len,
+	int mode, u32 size) {
+	u64 scratch[DAP_INFLIGHT * DAP_GROUP][DAP_BLOCK_MAX + 2];
+	DAPBLOCK block[DAP_INFLIGHT * DAP_GROUP];
+	u32 from[DAP_INFLIGHT * DAP_GROUP];
+	u64 status[DAP_INFLIGHT][2];
+	unsigned ticket[DAP_INFLIGHT];
+	u32 first[DAP_INFLIGHT];
+	u32 count[DAP_INFLIGHT];
+	u32 gfrom[DAP_INFLIGHT];
+	u32 gto[DAP_INFLIGHT];
+	DAPBLOCK *b, *next;
+	int write = (mode != XFER_READ);
+	u32 start = addr;
+	u32 total = len;
+	u32 resume = 0;
+	u32 redo = 0;
+	u32 tries = 0;
+	u32 miscompare = 0;
+	u32 bad_from = 0;
+	u32 bad_to = 0;
+	u32 n, i, k, m, g, gi, done, good, xfer, x, j;
+	int caps = 0;
+	int r = 0;
+	u64 v;
+
+	if (size == 4) {
+		size = 0;
+		if ((addr & 3) || (len & 3)) {
+			return -1;
+		}
+	} else if (size && ((addr | len) & (size - 1))) {
+		return -1;
+	}
+	if ((size && (size < 4)) || (write && ((addr | len) & 3))) {
+		if ((caps = dap_ap_caps(dap, apnum)) < 0) {
 			return -1;
 		}
-		for (n = 0; n < xfer; n += 4) {
-			switch(XPACC_STATUS(scratch[n/4])) {
-			case XPACC_WAIT: fprintf(stderr,"w"); break;
-			case XPACC_OK: fprintf(stderr,"o"); break;
-			default: fprintf(stderr,"?"); break;
+		if (!(caps & ((size == 2) ? AP_CAP_SIZE16 : AP_CAP_SIZE8))) {
+			fprintf(stderr, "dap: AP%u cannot do %s accesses\n", apnum,
+				(size == 2) ? "halfword" : "byte");
+			return -1;
+		}
+	}
+
+	if (mode == XFER_VERIFY) {
+		// goes out with the first group
+		q_dap_dp_wr(dap, DPACC_CSW, CSW_ENABLES | DPCSW_STICKYCMP);
+	}
+	for (k = 0, g = 0, done = 0; ; ) {
+		if ((len > 0) && (r == 0) && !redo && ((g - done) < DAP_INFLIGHT)) {
+			// queue a group, each block planned before the one
+			// ahead of it is queued, so they can be chained
+			gi = g % DAP_INFLIGHT;
+			first[gi] = k;
+			gfrom[gi] = addr;
+			// where the group ahead leaves TAR is only known if
+			// it completes, and if not, this one may not land
+			// below where the redo starts: set TAR afresh
+			dap->ap[apnum].valid &= ~AP_TAR_VALID;
+			b = block + (k % (DAP_INFLIGHT * DAP_GROUP));
+			dap_mem_plan(caps, addr, len, size, mode, b);
+			for (n = 1; b != NULL; n++) {
+				i = k % (DAP_INFLIGHT * DAP_GROUP);
+				from[i] = addr;
+				xfer = b->addr + b->count * b->step - addr;
+				if (xfer > len) {
+					xfer = len;
+				}
+				next = NULL;
+				// while retrying, a block to a group, so
+				// only the one that fails is redone
+				if ((n < (tries ? 1 : DAP_GROUP)) && (xfer < len)) {
+					next = block + ((k + 1) % (DAP_INFLIGHT * DAP_GROUP));
+					dap_mem_plan(caps, addr + xfer, len - xfer, size, mode, next);
+				}
+				q_dap_mem_block(dap, apnum, b, write ? (data + (addr - start)) : NULL,
+					scratch[i], next);
+				k++;
+				len -= xfer;
+				addr += xfer;
+				b = next;
+			}
+			count[gi] = k - first[gi];
+			gto[gi] = addr;
+			q_dap_status(dap, status[gi]);
+			if (jtag_submit(dap->jtag, &ticket[gi])) {
+				// still wait out any groups in flight
+				r = -1;
+				continue;
+			}
+			g++;
+			continue;
+		}
+		if (done == g) {
+			if (redo && (r == 0)) {
+				// start over from the access that waited, or
+				// the group that failed
+				if (redo == REDO_WAIT) {
+					if (dap_mem_wait_recover(dap)) {
+						r = -1;
+						break;
+					}
+					dap->stats.waits++;
+				} else if ((++tries > DAP_RETRY_MAX) || dap_recover(dap, tries)) {
+					fprintf(stderr, "dap: error at %08x, giving up\n", resume);
+					r = -1;
+					break;
+				} else {
+					dap->stats.retries++;
+				}
+				len += addr - resume;
+				addr = resume;
+				redo = 0;
+				continue;
+			}
+			break;
+		}
+		// oldest group in flight: wait for it, then check and unpack it
+		gi = done % DAP_INFLIGHT;
+		done++;
+		if (jtag_wait(dap->jtag, ticket[gi])) {
+			if ((r == 0) && !redo) {
+				redo = REDO_ERROR;
+				resume = gfrom[gi];
+			}
+			continue;
+		}
+		if (r || redo) {
+			continue;
+		}
+		b = block;
+		good = 0;
+		for (m = first[gi]; m < (first[gi] + count[gi]); m++) {
+			i = m % (DAP_INFLIGHT * DAP_GROUP);
+			b = block + i;
+			good = dap_block_done(scratch[i], b->count);
+			if (mode == XFER_READ) {
+				for (n = 0, x = b->addr; n < good; n++) {
+					v = scratch[i][n + 2] >> 3;
+					for (j = 0; j < b->step; j++, x++) {
+						// only the bytes asked for, of whole words
+						if ((x - start) < total) {
+							data[x - start] = v >> (8 * (x & 3));
+						}
+					}
+				}
+			}
+			if (good < b->count) {
+				break;
+			}
+		}
+		// a compare that faulted is not a miscompare, but an error
+		if ((mode == XFER_VERIFY) && (XPACC_STATUS(status[gi][1]) == XPACC_OK) &&
+			(((status[gi][1] >> 3) & (DPCSW_STICKYCMP | DPCSW_STICKYERR)) ==
+			DPCSW_STICKYCMP)) {
+			miscompare = 1;
+			bad_from = gfrom[gi];
+			bad_to = gto[gi];
+			r = -1;
+			continue;
+		}
+		if ((good < b->count) || (XPACC_STATUS(status[gi][0]) == XPACC_WAIT)) {
+			// an overrun is expected, any other error is not
+			if ((XPACC_STATUS(status[gi][0]) == XPACC_OK) &&
+				(XPACC_STATUS(status[gi][1]) == XPACC_OK) &&
+				((status[gi][1] >> 3) & DPCSW_STICKYERR)) {
+				redo = REDO_ERROR;
+				resume = gfrom[gi];
+				continue;
 			}
-			*x++ = scratch[n/4] >> 3;
+			redo = REDO_WAIT;
+			resume = b->addr + good * b->step;
+			if (resume < from[b - block]) {
+				resume = from[b - block];
+			}
+		} else if ((XPACC_STATUS(status[gi][0]) == XPACC_OK) &&
+			(XPACC_STATUS(status[gi][1]) == XPACC_OK) &&
+			((status[gi][1] >> 3) & (DPCSW_STICKYORUN | DPCSW_STICKYERR)) ==
+			DPCSW_STICKYORUN) {
+			// a WAIT on a scan whose ack nothing captured (one
+			// that sets up a block): redo the whole group
+			redo = REDO_WAIT;
+			resume = gfrom[gi];
+		} else if ((XPACC_STATUS(status[gi][0]) != XPACC_OK) ||
+			(XPACC_STATUS(status[gi][1]) != XPACC_OK) ||
+			((status[gi][1] >> 3) & (DPCSW_STICKYORUN | DPCSW_STICKYERR))) {
+			redo = REDO_ERROR;
+			resume = gfrom[gi];
+		} else {
+			// done: the retries were for some earlier group
+			tries = 0;
 		}
-		fprintf(stderr,"\n");
-		len -= xfer;
-		addr += xfer;
 	}
-	return 0;
+	if (r) {
+		dap_cache_flush(dap);
+	}
+	if (mode == XFER_VERIFY) {
+		// back to normal writes, clearing STICKYCMP
+		if (dap_dp_wr(dap, DPACC_CSW, CSW_ENABLES | DPCSW_STICKYCMP)) {
+			r = -1;
+		}
+		if (miscompare) {
+			dap_verify_report(dap, apnum, bad_from, data + (bad_from - start),
+				bad_to - bad_from);
+		}
+	}
+	return r;
+}
+
+int dap_mem_read(DAP *dap, u32 apnum, u32 addr, void *data, u32 len) {
+	return dap_mem_xfer(dap, apnum, addr, data, len, XFER_READ, 0);
 }
 
 int dap_mem_write(DAP *dap, u32 apnum, u32 addr, void *data, u32 len) {
-	u32 *x = data;
+	return dap_mem_xfer(dap, apnum, addr, data, len, XFER_WRITE, 0);
+}
+
+int dap_mem_verify(DAP *dap, u32 apnum, u32 addr, void *data, u32 len) {
+	return dap_mem_xfer(dap, apnum, addr, data, len, XFER_VERIFY, 0);
+}
+
+int dap_mem_read_sized(DAP *dap, u32 apnum, u32 addr, void *data, u32 len, u32 size) {
+	return dap_mem_xfer(dap, apnum, addr, data, len, XFER_READ, size);
+}
+
+int dap_mem_write_sized(DAP *dap, u32 apnum, u32 addr, void *data, u32 len, u32 size) {
+	return dap_mem_xfer(dap, apnum, addr, data, len, XFER_WRITE, size);
+}
+
+// Ops per commit in dap_mem_batch(), and the scans each may need:
+// SELECT, CSW, TAR, and DRW.
+#define DAP_BATCH_MAX	256
+#define DAP_BATCH_SCANS	4
+
+// RDBUFF polls to wait out an AP access left running by a WAIT
+#define DAP_DRAIN_MAX	10
+
+// After a WAIT, the first OK ack is the end of the AP access that was
+// still running, and carries what it read, as every scan in between
+// was dropped.  Poll for it with RDBUFF reads, which do nothing
+// themselves.  No abort: that could cut the access short after it
+// had had its effect, and it may not be one that can be done again.
+static int dap_ap_drain(DAP *dap, u64 *u) {
 	u32 n;
+	for (n = 0; n < DAP_DRAIN_MAX; n++) {
+		q_dap_ap_idle(dap);
+		q_dap_ir_wr(dap, DAP_IR_DPACC);
+		q_dap_dr_io(dap, 35, XPACC_RD(DPACC_RDBUFF), u);
+		if (jtag_commit(dap->jtag)) {
+			dap_cache_flush(dap);
+			return -1;
+		}
+		if (XPACC_STATUS(*u) == XPACC_OK) {
+			return 0;
+		}
+	}
+	fprintf(stderr, "dap: AP access did not complete\n");
+	return -1;
+}
 
-	if ((addr & 3) || (((u64) data) & 3)) {
-		// base and length must be aligned
+// Queue op[0..count-1] (count <= DAP_BATCH_MAX) and commit them.
+// Every scan captures the ack of the one before it, so all captures
+// are kept: the first that is not OK is where the DP started dropping
+// accesses.  The op whose DRW access was still running then is seen
+// through, rather than issued again, as debug registers like the DTRs
+// do not read or write the same twice.  Returns how many ops
+// completed, setting *wait if the rest were dropped on a WAIT, or
+// negative on error.
+static int dap_batch_run(DAP *dap, DAPOP *op, u32 count, int *wait) {
+	u64 scratch[DAP_BATCH_MAX * DAP_BATCH_SCANS + 1];
+	u32 ack[DAP_BATCH_MAX];
+	u64 status[2], u;
+	u32 n, s, t;
+
+	*wait = 0;
+	dap->capture = scratch;
+	dap->captured = 0;
+	for (n = 0; n < count; n++) {
+		q_dap_ap_wr(dap, op[n].apnum, APACC_CSW, DAP_MEM_CSW);
+		q_dap_ap_wr(dap, op[n].apnum, APACC_TAR, op[n].addr);
+		if (op[n].write) {
+			q_dap_ap_wr(dap, op[n].apnum, APACC_DRW, op[n].val);
+		} else {
+			q_dap_ap_rd(dap, op[n].apnum, APACC_DRW);
+		}
+		// the next scan, whatever it is, has this op's ack
+		ack[n] = dap->captured;
+	}
+	q_dap_ir_wr(dap, DAP_IR_DPACC);
+	q_dap_dr_io(dap, 35, XPACC_RD(DPACC_RDBUFF), NULL);
+	dap->capture = NULL;
+	q_dap_status(dap, status);
+	if (jtag_commit(dap->jtag)) {
+		dap_cache_flush(dap);
 		return -1;
 	}
 
-	while (len > 0) {
-		// max transfer is 1K
-		// transfer may not cross 1K boundary
-		u32 xfer = 1024 - (addr & 0x3FF);
-		if (xfer > len) {
-			xfer = len;
+	for (s = 0; s < dap->captured; s++) {
+		if (XPACC_STATUS(scratch[s]) != XPACC_OK) {
+			break;
 		}
-		q_dap_ap_wr(dap, apnum, APACC_CSW, APCSW_DBGSWEN | APCSW_INCR_SINGLE | APCSW_SIZE32);
-		q_dap_dr_io(dap, 35, XPACC_WR(APACC_TAR, addr), NULL);
-		for (n = 0; n < xfer; n += 4) {
-			_q_dap_ir_wr(dap, DAP_IR_APACC); // HACK, timing
-			q_dap_dr_io(dap, 35, XPACC_WR(APACC_DRW, *x++), NULL);
+	}
+	for (n = 0; (n < count) && (ack[n] < s); n++) {
+		;
+	}
+	if ((n < count) || (XPACC_STATUS(status[0]) == XPACC_WAIT)) {
+		// the SELECT, CSW, and TAR writes since were dropped
+		dap_cache_flush(dap);
+		for (t = s + 1; t < dap->captured; t++) {
+			if (XPACC_STATUS(scratch[t]) == XPACC_OK) {
+				break;
+			}
 		}
-		if (dap_commit(dap)) {
+		if (t < dap->captured) {
+			u = scratch[t];
+		} else if (XPACC_STATUS(status[0]) == XPACC_OK) {
+			u = status[0];
+		} else if (XPACC_STATUS(status[1]) == XPACC_OK) {
+			u = status[1];
+		} else if (dap_ap_drain(dap, &u)) {
+			return -1;
+		}
+		if ((n < count) && (ack[n] == s)) {
+			scratch[ack[n]] = u;
+			n++;
+		}
+		// an overrun is expected, any other error is not
+		q_dap_status(dap, status);
+		if (jtag_commit(dap->jtag) ||
+			(XPACC_STATUS(status[0]) != XPACC_OK) ||
+			(XPACC_STATUS(status[1]) != XPACC_OK) ||
+			((status[1] >> 3) & DPCSW_STICKYERR)) {
+			fprintf(stderr, "dap: error\n");
+			dap_cache_flush(dap);
+			return -1;
+		}
+		*wait = 1;
+	} else if (dap_check_status(status)) {
+		dap_cache_flush(dap);
+		return -1;
+	}
+	count = n;
+	for (n = 0; n < count; n++) {
+		if (!op[n].write) {
+			op[n].val = scratch[ack[n]] >> 3;
+		}
+		op[n].status = DAP_OP_OK;
+	}
+	return count;
+}
+
+int dap_mem_batch(DAP *dap, DAPOP *op, u32 count) {
+	u32 n;
+	int done, wait;
+
+	for (n = 0; n < count; n++) {
+		op[n].status = DAP_OP_PENDING;
+	}
+	for (n = 0; n < count; n++) {
+		if (op[n].addr & 3) {
+			op[n].status = DAP_OP_ERROR;
 			return -1;
-		} 
-		len -= xfer;
-		addr += xfer;
+		}
+	}
+	while (count > 0) {
+		n = (count > DAP_BATCH_MAX) ? DAP_BATCH_MAX : count;
+		if ((done = dap_batch_run(dap, op, n, &wait)) < 0) {
+			while (n-- > 0) {
+				op[n].status = DAP_OP_ERROR;
+			}
+			return -1;
+		}
+		op += done;
+		count -= done;
+		// the AP is idle again, so clearing the overrun is enough
+		if (wait && (dap_idle_raise(dap) ||
+			dap_dp_wr(dap, DPACC_CSW, CSW_ERRORS | CSW_ENABLES))) {
+			if (count > 0) {
+				op->status = DAP_OP_WAIT;
+			}
+			return -1;
+		}
 	}
 	return 0;
 }
 
+// Live sampling: a round reads each address once, with a TAR write
+// only where the address does not follow on from the one before, and
+// the rounds of a group end with a TAR read to pick up the last word.
+// The accesses of a group of rounds (about DAP_SAMPLE_OPS reads) are
+// recorded once as a program for each group in flight, capturing into
+// its own scratch, so each run is a prebuilt program plus a status
+// query.  SELECT and CSW are set up before, and are left alone.
+#define DAP_SAMPLE_OPS	256
+
+// Record rounds rounds of reads of addr[0..count-1], captures landing
+// in scratch from 0 on; data[n] is the capture that has read n's data.
+static JPROG *dap_sample_record(DAP *dap, const u32 *addr, u32 count, u32 rounds,
+	u64 *scratch, u32 *data) {
+	u32 ir = DAP_IR_APACC;
+	u32 r, i, n, s, tar;
+	int valid = 0;
+
+	if (jtag_prog_begin(dap->jtag)) {
+		return NULL;
+	}
+	jtag_ir_wr(dap->jtag, 4, &ir);
+	for (r = 0, n = 0, s = 0, tar = 0; r < rounds; r++) {
+		for (i = 0; i < count; i++) {
+			if (!valid || (tar != addr[i])) {
+				q_dap_dr_io(dap, 35, XPACC_WR(APACC_TAR, addr[i]), scratch + s++);
+				q_dap_ap_idle(dap);
+				tar = addr[i];
+			}
+			q_dap_dr_io(dap, 35, XPACC_RD(APACC_DRW), scratch + s++);
+			q_dap_ap_idle(dap);
+			data[n++] = s;
+			tar += 4;
+			valid = (tar & 0x3FF) != 0;
+		}
+	}
+	q_dap_dr_io(dap, 35, XPACC_RD(APACC_TAR), scratch + s);
+	q_dap_ap_idle(dap);
+	return jtag_prog_end(dap->jtag);
+}
+
+int dap_mem_sample(DAP *dap, u32 apnum, const u32 *addr, u32 count,
+	int (*fn)(void *cookie, u64 ns, u32 *val), void *cookie) {
+	JPROG *prog[DAP_INFLIGHT];
+	u64 *scratch[DAP_INFLIGHT];
+	u32 *data[DAP_INFLIGHT];
+	u64 status[DAP_INFLIGHT][2];
+	unsigned ticket[DAP_INFLIGHT];
+	u32 val[DAP_SAMPLE_MAX];
+	u32 rounds, scans, g, gi, done, good, r, i, s;
+	u64 then, now;
+	int rc = 0, stop = 0, redo = 0;
+
+	if ((count == 0) || (count > DAP_SAMPLE_MAX)) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (addr[i] & 3) {
+			return -1;
+		}
+	}
+	rounds = DAP_SAMPLE_OPS / count;
+	scans = rounds * count * 2 + 1;
+	memset(prog, 0, sizeof(prog));
+	memset(scratch, 0, sizeof(scratch));
+	memset(data, 0, sizeof(data));
+	for (gi = 0; gi < DAP_INFLIGHT; gi++) {
+		scratch[gi] = malloc(scans * sizeof(u64));
+		data[gi] = malloc(rounds * count * sizeof(u32));
+		if ((scratch[gi] == NULL) || (data[gi] == NULL)) {
+			rc = -1;
+			goto done;
+		}
+	}
+
+	while (!stop) {
+		q_dap_ap_wr(dap, apnum, APACC_CSW, DAP_MEM_CSW);
+		q_dap_select(dap, apnum, APACC_DRW);
+		if (dap_commit(dap)) {
+			rc = -1;
+			break;
+		}
+		// recorded with the idle of the time, so again after a WAIT
+		for (gi = 0; gi < DAP_INFLIGHT; gi++) {
+			if ((prog[gi] == NULL) && ((prog[gi] = dap_sample_record(dap,
+				addr, count, rounds, scratch[gi], data[gi])) == NULL)) {
+				rc = -1;
+				goto done;
+			}
+		}
+		// the programs move TAR, and leave IR at APACC
+		dap->ap[apnum].valid &= ~AP_TAR_VALID;
+
+		then = NOW();
+		for (g = 0, done = 0; ; ) {
+			if (!stop && !redo && ((g - done) < DAP_INFLIGHT)) {
+				gi = g % DAP_INFLIGHT;
+				dap->cached_ir = 0xFFFFFFFF;
+				jtag_prog_run(dap->jtag, prog[gi]);
+				q_dap_status(dap, status[gi]);
+				if (jtag_submit(dap->jtag, &ticket[gi])) {
+					rc = -1;
+					stop = 1;
+					continue;
+				}
+				g++;
+				continue;
+			}
+			if (done == g) {
+				break;
+			}
+			gi = done % DAP_INFLIGHT;
+			done++;
+			if (jtag_wait(dap->jtag, ticket[gi])) {
+				rc = -1;
+				stop = 1;
+				continue;
+			}
+			now = NOW();
+			if (stop || redo) {
+				continue;
+			}
+			// rounds whose data came back before the first WAIT
+			for (s = 0; s < scans; s++) {
+				if (XPACC_STATUS(scratch[gi][s]) != XPACC_OK) {
+					break;
+				}
+			}
+			for (good = 0; good < rounds; good++) {
+				if (data[gi][good * count + count - 1] >= s) {
+					break;
+				}
+			}
+			if ((good < rounds) || (XPACC_STATUS(status[gi][0]) == XPACC_WAIT)) {
+				// an overrun is expected, any other error is not
+				if ((XPACC_STATUS(status[gi][0]) == XPACC_OK) &&
+					(XPACC_STATUS(status[gi][1]) == XPACC_OK) &&
+					((status[gi][1] >> 3) & DPCSW_STICKYERR)) {
+					fprintf(stderr, "dap: error\n");
+					rc = -1;
+					stop = 1;
+					continue;
+				}
+				redo = 1;
+			} else if (dap_check_status(status[gi])) {
+				rc = -1;
+				stop = 1;
+				continue;
+			}
+			// the rounds of a group are evenly spaced in time
+			for (r = 0; r < good; r++) {
+				for (i = 0; i < count; i++) {
+					val[i] = scratch[gi][data[gi][r * count + i]] >> 3;
+				}
+				if (fn(cookie, then + ((now - then) * (r + 1)) / rounds, val)) {
+					stop = 1;
+					break;
+				}
+			}
+			then = now;
+		}
+		if (redo && !stop) {
+			// go again, idling longer
+			if (dap_mem_wait_recover(dap)) {
+				rc = -1;
+				break;
+			}
+			for (gi = 0; gi < DAP_INFLIGHT; gi++) {
+				jtag_prog_free(dap->jtag, prog[gi]);
+				prog[gi] = NULL;
+			}
+			redo = 0;
+		}
+	}
+done:
+	for (gi = 0; gi < DAP_INFLIGHT; gi++) {
+		if (prog[gi]) {
+			jtag_prog_free(dap->jtag, prog[gi]);
+		}
+		free(scratch[gi]);
+		free(data[gi]);
+	}
+	if (redo && (rc == 0)) {
+		// stopped with the overrun of a WAIT still set
+		dap_clear_overrun(dap);
+	}
+	if (rc) {
+		dap_cache_flush(dap);
+	}
+	return rc;
+}
+
 DAP *dap_init(JTAG *jtag, u32 id) {
 	DAP *dap = malloc(sizeof(DAP));
 	memset(dap, 0, sizeof(DAP));
 	dap->jtag = jtag;
 	dap->cached_ir = 0xFFFFFFFF;
 	dap->device_id = id;
+	dap->idle = DAP_IDLE_DEFAULT;
 	return dap;
 }
 
+void dap_free(DAP *dap) {
+	free(dap);
+}
+
+// Idle calibration: read DAP_CAL_WORDS words of memory the caller
+// names back to back, with fewer and fewer idle TCKs between them,
+// until some WAIT.  The fewest that never did is used from then on.
+// How long an access takes depends on the bus clock of the part and
+// the TCK rate, so results are cached by DAP IDCODE and TCK kHz in
+// the file JTAG_DAP_CACHE, if set, where dap_attach() finds them.
+// Every Zynq has the same DAP IDCODE, so the IDCODEs of the whole
+// chain are the key, telling at least the parts apart.
+// JTAG_DAP_IDLE=<n> skips all this.
+#define DAP_CAL_WORDS	64
+#define DAP_CAL_START	32
+
+// 1 if any access waited, 0 if none did, negative on error
+static int dap_cal_probe(DAP *dap, u32 apnum, u32 addr, u32 idle) {
+	DAPBLOCK b = {
+		.addr = addr,
+		.csw = DAP_MEM_CSW,
+		.step = 4,
+		.count = DAP_CAL_WORDS,
+	};
+	u64 scratch[DAP_CAL_WORDS + 2];
+	u64 status[2];
+	dap->idle = idle;
+	q_dap_mem_block(dap, apnum, &b, NULL, scratch, NULL);
+	q_dap_status(dap, status);
+	if (jtag_commit(dap->jtag)) {
+		dap_cache_flush(dap);
+		return -1;
+	}
+	if ((dap_block_done(scratch, DAP_CAL_WORDS) < DAP_CAL_WORDS) ||
+		(XPACC_STATUS(status[0]) == XPACC_WAIT)) {
+		return dap_clear_overrun(dap) ? -1 : 1;
+	}
+	return dap_check_status(status) ? -1 : 0;
+}
+
+static int dap_cal_search(DAP *dap, u32 apnum, u32 addr) {
+	u32 good, bad, mid;
+	int r;
+
+	// find an idle that never waits
+	for (good = DAP_CAL_START; (r = dap_cal_probe(dap, apnum, addr, good)) == 1; good *= 2) {
+		if (good >= DAP_IDLE_MAX) {
+			return -1;
+		}
+	}
+	if (r < 0) {
+		return -1;
+	}
+	// halve it until some access waits, then home in on the edge
+	for (bad = good; good > 0; good = bad) {
+		bad = good / 2;
+		if ((r = dap_cal_probe(dap, apnum, addr, bad)) < 0) {
+			return -1;
+		}
+		if (r == 1) {
+			break;
+		}
+	}
+	while ((good > 0) && ((good - bad) > 1)) {
+		mid = (good + bad) / 2;
+		if ((r = dap_cal_probe(dap, apnum, addr, mid)) < 0) {
+			return -1;
+		}
+		if (r == 1) {
+			bad = mid;
+		} else {
+			good = mid;
+		}
+	}
+	return good;
+}
+
+#define DAP_CAL_KEYLEN	128
+
+// the IDCODEs of the chain, as "4ba00477,03727093"
+static void dap_cal_key(DAP *dap, char *key) {
+	JTAG_INFO *info;
+	u32 len = 0;
+	int n;
+	key[0] = 0;
+	for (n = 0; (info = jtag_get_nth_device(dap->jtag, n)) != NULL; n++) {
+		if ((len + 10) > DAP_CAL_KEYLEN) {
+			break;
+		}
+		len += sprintf(key + len, n ? ",%08x" : "%08x", info->idcode);
+	}
+}
+
+static int dap_cal_load(DAP *dap, int khz, u32 *idle) {
+	const char *fn = getenv("JTAG_DAP_CACHE");
+	char key[DAP_CAL_KEYLEN], a[DAP_CAL_KEYLEN], line[DAP_CAL_KEYLEN + 32];
+	unsigned c;
+	int b, r = -1;
+	FILE *fp;
+	if ((fn == NULL) || ((fp = fopen(fn, "r")) == NULL)) {
+		return -1;
+	}
+	dap_cal_key(dap, key);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%127s %d %u", a, &b, &c) != 3) {
+			continue;
+		}
+		if (!strcmp(a, key) && (b == khz)) {
+			*idle = c;
+			r = 0;
+		}
+	}
+	fclose(fp);
+	return r;
+}
+
+static void dap_cal_save(DAP *dap, int khz, u32 idle) {
+	const char *fn = getenv("JTAG_DAP_CACHE");
+	char key[DAP_CAL_KEYLEN];
+	FILE *fp;
+	if ((fn == NULL) || ((fp = fopen(fn, "a")) == NULL)) {
+		return;
+	}
+	dap_cal_key(dap, key);
+	// later lines win when loading
+	fprintf(fp, "%s %d %u\n", key, khz, idle);
+	fclose(fp);
+}
+
+// the idle from JTAG_DAP_IDLE or the cache, if either has one
+static int dap_cal_preset(DAP *dap) {
+	const char *s;
+	if ((s = getenv("JTAG_DAP_IDLE")) != NULL) {
+		dap->idle = strtoul(s, 0, 0);
+		return 0;
+	}
+	return dap_cal_load(dap, jtag_setspeed(dap->jtag, -1), &dap->idle);
+}
+
+int dap_calibrate(DAP *dap, u32 apnum, u32 addr) {
+	int khz, idle;
+
+	// one run of TAR auto-increment
+	if ((addr & 3) || (((addr & 0x3FF) + DAP_CAL_WORDS * 4) > 0x400)) {
+		fprintf(stderr, "dap: cannot calibrate at %08x, %u words must be aligned within 1K\n",
+			addr, DAP_CAL_WORDS);
+		return -1;
+	}
+	if (dap_cal_preset(dap) == 0) {
+		return 0;
+	}
+	khz = jtag_setspeed(dap->jtag, -1);
+	if ((idle = dap_cal_search(dap, apnum, addr)) < 0) {
+		dap->idle = DAP_IDLE_DEFAULT;
+		dap_clear_overrun(dap);
+		fprintf(stderr, "dap: cannot calibrate, idling %u TCKs per access\n", dap->idle);
+		return -1;
+	}
+	dap->idle = idle;
+	dap_cal_save(dap, khz, dap->idle);
+	return 0;
+}
+
 int dap_attach(DAP *dap) {
 	unsigned n;
 	u32 x;
@@ -281,68 +1391,273 @@ int dap_attach(DAP *dap) {
 			continue;
 		if (!(x & DPCSW_CDBGPWRUPACK))
 			continue;
+		dap_cal_preset(dap);
 		return 0;
 	}
 	fprintf(stderr,"dap: attach failed\n");
 	return -1;
 }
 
-static int read4xid(DAP *dap, u32 n, u32 addr, u32 *val) {
-	u32 a,b,c,d;
-	if (dap_mem_rd32(dap, n, addr + 0x00, &a)) return -1;
-	if (dap_mem_rd32(dap, n, addr + 0x04, &b)) return -1;
-	if (dap_mem_rd32(dap, n, addr + 0x08, &c)) return -1;
-	if (dap_mem_rd32(dap, n, addr + 0x0C, &d)) return -1;
-	*val = (a & 0xFF) | ((b & 0xFF) << 8) | ((c & 0xFF) << 16) | ((d & 0xFF) << 24);
+// ROM table discovery.  The tables are walked a level at a time: the
+// ID registers of every component found so far go out in one batch,
+// then the entries of every ROM table among them in another, and what
+// those point at is the next level.  The map is kept by DAP IDCODE,
+// AP number, and AP IDR in the file JTAG_DAP_ROMCACHE, if set, so
+// later runs need not walk at all.
+#define ROM_ENTRIES	128
+#define ROM_ID_WORDS	13	// MEMTYPE/DEVTYPE, PID4-7, PID0-3, CID0-3
+
+#define CID_VALID(cid)	(((cid) & 0xFFFF0FFF) == 0xB105000D)
+#define CID_CLASS(cid)	(((cid) >> 12) & 0xF)
+#define CID_CLASS_ROM	1
+
+// Queue reads of count words from addr on.
+static void batch_reads(DAPOP *op, u32 n, u32 addr, u32 count) {
+	u32 i;
+	for (i = 0; i < count; i++) {
+		op[i].apnum = n;
+		op[i].addr = addr + i * 4;
+		op[i].write = 0;
+	}
+}
+
+// four ID registers, one byte each
+static u32 unpack_4xid(DAPOP *op) {
+	return (op[0].val & 0xFF) | ((op[1].val & 0xFF) << 8) |
+		((op[2].val & 0xFF) << 16) | ((op[3].val & 0xFF) << 24);
+}
+
+// Fill in the IDs of c[0..count-1], all in one batch, or if that
+// fails, a component at a time, so that one which cannot be read
+// (powered down, say) does not lose the rest.  It gets a cid of 0.
+static int dap_rom_ids(DAP *dap, DAPCOMP *c, u32 count) {
+	DAPOP *op, *o;
+	u32 i;
+	int r;
+
+	if ((op = malloc(count * ROM_ID_WORDS * sizeof(DAPOP))) == NULL) {
+		return -1;
+	}
+	// 0xFCC up to 0xFFC, in order, so TAR is written once for each
+	for (i = 0; i < count; i++) {
+		batch_reads(op + i * ROM_ID_WORDS, c[i].apnum, c[i].base + 0xFCC, ROM_ID_WORDS);
+	}
+	r = dap_mem_batch(dap, op, count * ROM_ID_WORDS);
+	for (i = 0; i < count; i++) {
+		o = op + i * ROM_ID_WORDS;
+		if (r && dap_mem_batch(dap, o, ROM_ID_WORDS)) {
+			c[i].cid = 0;
+			continue;
+		}
+		c[i].type = o[0].val;
+		c[i].pid1 = unpack_4xid(o + 1);
+		c[i].pid0 = unpack_4xid(o + 5);
+		c[i].cid = unpack_4xid(o + 9);
+	}
+	free(op);
 	return 0;
 }
 
-static int readinfo(DAP *dap, u32 n, u32 base, u32 *cid, u32 *pid0, u32 *pid1) {
-	if (read4xid(dap, n, base + 0xFF0, cid)) return -1;
-	if (read4xid(dap, n, base + 0xFE0, pid0)) return -1;
-	if (read4xid(dap, n, base + 0xFD0, pid1)) return -1;
+static int dap_rom_known(DAP *dap, u32 apnum, u32 base) {
+	u32 i;
+	for (i = 0; i < dap->ncomp; i++) {
+		if ((dap->comp[i].apnum == apnum) && (dap->comp[i].base == base)) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
-static void dumptable(DAP *dap, u32 n, u32 base) {
-	u32 cid, pid0, pid1, memtype;
-	u32 x, addr;
-	int i;
+// Add the ROM table of AP apnum at base, and everything under it, to
+// the map, breadth first.  1 if something could not be read, so the
+// map may be incomplete, negative on error.
+static int dap_rom_walk(DAP *dap, u32 apnum, u32 base) {
+	DAPCOMP *c;
+	DAPOP *op, *e;
+	u32 lo, hi, i, j, n, x;
+	int r, missed = 0;
 
-	printf("TABLE   @%08x ", base);
-	if (readinfo(dap, n, base, &cid, &pid0, &pid1)) {
-		printf("<error reading cid & pid>\n");
-		return;
+	if (dap->ncomp == DAP_COMP_MAX) {
+		return 1;
 	}
-	if (dap_mem_rd32(dap, n, base + 0xFCC, &memtype)) {
-		printf("<error reading memtype>\n");
+	c = dap->comp + dap->ncomp++;
+	memset(c, 0, sizeof(DAPCOMP));
+	c->apnum = apnum;
+	c->base = base;
+
+	for (lo = dap->ncomp - 1, hi = dap->ncomp; lo < hi; lo = hi, hi = dap->ncomp) {
+		if (dap_rom_ids(dap, dap->comp + lo, hi - lo)) {
+			return -1;
+		}
+		// drop any that did not read back as a component
+		for (i = n = lo; i < hi; i++) {
+			if (CID_VALID(dap->comp[i].cid)) {
+				dap->comp[n++] = dap->comp[i];
+			} else {
+				missed = 1;
+			}
+		}
+		dap->ncomp = hi = n;
+
+		for (i = lo, n = 0; i < hi; i++) {
+			if (CID_CLASS(dap->comp[i].cid) == CID_CLASS_ROM) {
+				n++;
+			}
+		}
+		if (n == 0) {
+			break;
+		}
+		if ((op = malloc(n * ROM_ENTRIES * sizeof(DAPOP))) == NULL) {
+			return -1;
+		}
+		for (i = lo, n = 0; i < hi; i++) {
+			if (CID_CLASS(dap->comp[i].cid) == CID_CLASS_ROM) {
+				batch_reads(op + n++ * ROM_ENTRIES, apnum, dap->comp[i].base, ROM_ENTRIES);
+			}
+		}
+		r = dap_mem_batch(dap, op, n * ROM_ENTRIES);
+		for (i = lo, n = 0; i < hi; i++) {
+			if (CID_CLASS(dap->comp[i].cid) != CID_CLASS_ROM) {
+				continue;
+			}
+			e = op + n++ * ROM_ENTRIES;
+			if (r && dap_mem_batch(dap, e, ROM_ENTRIES)) {
+				missed = 1;
+				continue;
+			}
+			for (j = 0; j < ROM_ENTRIES; j++) {
+				x = e[j].val;
+				if (x == 0) break;
+				if ((x & 3) != 3) continue;
+				// offsets are signed, and tables may point back up
+				x = dap->comp[i].base + (x & 0xFFFFF000);
+				if (dap_rom_known(dap, apnum, x)) continue;
+				if (dap->ncomp == DAP_COMP_MAX) {
+					missed = 1;
+					break;
+				}
+				c = dap->comp + dap->ncomp++;
+				memset(c, 0, sizeof(DAPCOMP));
+				c->apnum = apnum;
+				c->base = x;
+				c->depth = dap->comp[i].depth + 1;
+			}
+		}
+		free(op);
+	}
+	return missed;
+}
+
+// Add the components of AP apnum to the map from the cache, if it has
+// them.  Records are a "idcode apnum idr count" line, then count lines
+// of "base cid pid0 pid1 type depth".  Later records win.
+static int dap_rom_load(DAP *dap, u32 apnum, u32 idr) {
+	const char *fn = getenv("JTAG_DAP_ROMCACHE");
+	unsigned a, b, c, count, i;
+	DAPCOMP x, *p;
+	int hit, r = -1;
+	FILE *fp;
+	if ((fn == NULL) || ((fp = fopen(fn, "r")) == NULL)) {
+		return -1;
+	}
+	while (fscanf(fp, "%x %u %x %u", &a, &b, &c, &count) == 4) {
+		hit = (a == dap->device_id) && (b == apnum) && (c == idr) &&
+			(count <= (DAP_COMP_MAX - dap->ncomp));
+		for (i = 0; i < count; i++) {
+			p = hit ? (dap->comp + dap->ncomp + i) : &x;
+			if (fscanf(fp, "%x %x %x %x %x %u", &p->base, &p->cid,
+				&p->pid0, &p->pid1, &p->type, &p->depth) != 6) {
+				// a hit may have overwritten an earlier one
+				if (hit) r = -1;
+				goto done;
+			}
+			p->apnum = apnum;
+		}
+		if (hit) {
+			r = count;
+		}
+	}
+done:
+	fclose(fp);
+	if (r < 0) {
+		return -1;
+	}
+	dap->ncomp += r;
+	return 0;
+}
+
+static void dap_rom_save(DAP *dap, u32 apnum, u32 idr, u32 first) {
+	const char *fn = getenv("JTAG_DAP_ROMCACHE");
+	DAPCOMP *c;
+	FILE *fp;
+	if ((fn == NULL) || ((fp = fopen(fn, "a")) == NULL)) {
 		return;
 	}
-	printf("CID %08x  PID %08x %08x  %dKB%s\n", cid, pid1, pid0,
-		4 * (1 + ((pid1 & 0xF0) >> 4)),
-		(memtype & 1) ? "  SYSMEM": "");
-	for (i = 0; i < 128; i++) {
-		if (dap_mem_rd32(dap, n, base + i * 4, &x)) break;
-		if (x == 0) break;
-		if ((x & 3) != 3) continue;
-		addr = base + (x & 0xFFFFF000);
-		if (readinfo(dap, n, addr, &cid, &pid0, &pid1)) {
-			printf("    <error reading cid & pid>\n");
-			continue;
+	fprintf(fp, "%08x %u %08x %u\n", dap->device_id, apnum, idr, dap->ncomp - first);
+	for (c = dap->comp + first; c < dap->comp + dap->ncomp; c++) {
+		fprintf(fp, "%08x %08x %08x %08x %08x %u\n",
+			c->base, c->cid, c->pid0, c->pid1, c->type, c->depth);
+	}
+	fclose(fp);
+}
+
+int dap_discover(DAP *dap, DAPCOMP **list) {
+	u32 n, idr, base, first;
+	int r;
+
+	if (!dap->discovered) {
+		dap->ncomp = 0;
+		for (n = 0; n < 256; n++) {
+			if (dap_ap_rd(dap, n, APACC_IDR, &idr))
+				break;
+			if (idr == 0)
+				break;
+			if (dap_rom_load(dap, n, idr) == 0)
+				continue;
+			first = dap->ncomp;
+			if (dap_ap_rd(dap, n, APACC_BASE, &base))
+				return -1;
+			r = 0;
+			// ADIv5 keeps format and present flags in the low bits
+			if (base && (base != 0xFFFFFFFF) && ((base & 3) != 2)) {
+				r = dap_rom_walk(dap, n, base & 0xFFFFF000);
+			}
+			if (r < 0)
+				return -1;
+			// a partial map is used, but not kept
+			if (r == 0)
+				dap_rom_save(dap, n, idr, first);
 		}
-		printf("    %02d: @%08x CID %08x  PID %08x %08x  %dKB\n",
-			i, addr, cid, pid1, pid0,
-			4 * (1 + ((pid1 & 0xF0) >> 4)));
-		if (((cid >> 12) & 0xF) == 1) {
-			dumptable(dap, n, addr);
+		dap->discovered = 1;
+	}
+	*list = dap->comp;
+	return dap->ncomp;
+}
+
+int dap_find_component(DAP *dap, u32 part, u32 nth, u32 *apnum, u32 *base) {
+	DAPCOMP *c;
+	int i, n;
+	if ((n = dap_discover(dap, &c)) < 0) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if ((CS_PART(c[i].pid0) == part) && (nth-- == 0)) {
+			*apnum = c[i].apnum;
+			*base = c[i].base;
+			return 0;
 		}
 	}
+	return -1;
 }
 
 int dap_probe(DAP *dap) {
+	DAPCOMP *c;
 	unsigned n;
+	int i, count, rom;
 	u32 x, y;
 
+	if ((count = dap_discover(dap, &c)) < 0)
+		return -1;
 	for (n = 0; n < 256; n++) {
 		if (dap_ap_rd(dap, n, APACC_IDR, &x))
 			break;
@@ -351,8 +1666,15 @@ int dap_probe(DAP *dap) {
 		y = 0;
 		dap_ap_rd(dap, n, APACC_BASE, &y);
 		printf("AP%d ID=%08x BASE=%08x\n", n, x, y);
-		if (y && (y != 0xFFFFFFFF)) {
-			dumptable(dap, n, y);
+		for (i = 0; i < count; i++) {
+			if (c[i].apnum != n)
+				continue;
+			rom = (CID_CLASS(c[i].cid) == CID_CLASS_ROM);
+			printf("%*s%s@%08x CID %08x  PID %08x %08x  %dKB%s\n",
+				c[i].depth * 4, "", rom ? "TABLE " : "",
+				c[i].base, c[i].cid, c[i].pid1, c[i].pid0,
+				4 * (1 + ((c[i].pid1 & 0xF0) >> 4)),
+				(rom && (c[i].type & 1)) ? "  SYSMEM": "");
 		}
 		if (dap_ap_rd(dap, n, APACC_CSW, &x) == 0)
 			printf("AP%d CSW=%08x\n", n, x);
@@ -10,15 +10,107 @@ typedef struct DAP DAP;
 int dap_mem_wr32(DAP *dap, u32 n, u32 addr, u32 val);
 int dap_mem_rd32(DAP *dap, u32 n, u32 addr, u32 *val);
 
-// multi-word io -- must be 32bit aligned
-// len in bytes, must be 32bit aligned
+// multi-byte io -- any alignment, len in bytes
+// reads cover whole words; writes use byte and halfword accesses
+// for any unaligned head and tail, so the AP must support them
 int dap_mem_read(DAP *dap, u32 apnum, u32 addr, void *data, u32 len);
 int dap_mem_write(DAP *dap, u32 apnum, u32 addr, void *data, u32 len);
 
-int dap_attach(DAP *dap); 
+// check that memory holds data, using pushed-verify writes, so the
+// check costs what a write does rather than a read -- 0 if it does,
+// negative (with the first differing address reported) if not
+int dap_mem_verify(DAP *dap, u32 apnum, u32 addr, void *data, u32 len);
+
+// multi-byte io where every bus access is size (1, 2, or 4) bytes,
+// for peripherals that care -- addr and len must be aligned to size
+// packed transfers are used where the AP supports them
+int dap_mem_read_sized(DAP *dap, u32 apnum, u32 addr, void *data, u32 len, u32 size);
+int dap_mem_write_sized(DAP *dap, u32 apnum, u32 addr, void *data, u32 len, u32 size);
+
+// one access of a dap_mem_batch()
+typedef struct {
+	u32 apnum;
+	u32 addr;	// must be 32bit aligned
+	u32 write;	// 0 to read into val
+	u32 val;
+	u32 status;	// set to one of DAP_OP_*
+} DAPOP;
+
+#define DAP_OP_OK	0
+#define DAP_OP_PENDING	1	// not done, as an earlier op failed
+#define DAP_OP_WAIT	2	// the AP would not finish it
+#define DAP_OP_ERROR	3	// its commit failed (may have been done)
+
+// Word accesses, in order, packed into as few commits as the DAP can
+// check.  Stops at the first op that fails.  Returns 0 if all of them
+// were done.
+int dap_mem_batch(DAP *dap, DAPOP *op, u32 count);
+
+#define DAP_SAMPLE_MAX	64
+
+// Read the words at addr[0..count-1] (count <= DAP_SAMPLE_MAX) over
+// and over, back to back, without stopping anything, and pass each
+// round of them to fn, with the host time they were read at (ns of
+// CLOCK_MONOTONIC_RAW, spread evenly over each commit's rounds).
+// Runs until fn returns nonzero, then returns 0, or negative on error.
+int dap_mem_sample(DAP *dap, u32 apnum, const u32 *addr, u32 count,
+	int (*fn)(void *cookie, u64 ns, u32 *val), void *cookie);
+
+// a CoreSight component found in the ROM tables of an AP
+typedef struct {
+	u32 apnum;
+	u32 base;
+	u32 cid;	// CIDR0-3, a byte each
+	u32 pid0;	// PIDR0-3
+	u32 pid1;	// PIDR4-7
+	u32 type;	// MEMTYPE of a ROM table, DEVTYPE of anything else
+	u32 depth;	// 0 for the table the AP's BASE points at
+} DAPCOMP;
+
+#define DAP_COMP_MAX	256
+
+// JEP106 designer and part number of a component, from its pid0
+#define CS_PART(pid0)		((pid0) & 0x7FFFF)
+#define CS_ARM(part)		((0x3B << 12) | (part))
+#define CS_CORTEX_A9_DEBUG	CS_ARM(0xC09)
+
+// Walk the ROM tables of every AP (the first call only) and point
+// *list at the components found, tables before what they hold.
+// Returns how many, or negative on error.  With JTAG_DAP_ROMCACHE
+// set, the map is kept there and later runs skip the walk.
+int dap_discover(DAP *dap, DAPCOMP **list);
+
+// The AP and base of the nth (from 0) component whose CS_PART() is
+// part, in dap_discover() order.  Negative if there is no such one.
+int dap_find_component(DAP *dap, u32 part, u32 nth, u32 *apnum, u32 *base);
+
+int dap_attach(DAP *dap);
+
+// Find the fewest idle TCKs an AP memory access needs to complete, by
+// reading 256 bytes of memory at addr through AP apnum, which must be
+// there and not mind being read, word aligned and within one 1K
+// block.  dap_attach() only picks up JTAG_DAP_IDLE or an earlier
+// result.  Negative if it could not, in which case a safe default is
+// used.
+int dap_calibrate(DAP *dap, u32 apnum, u32 addr);
 
 DAP *dap_init(JTAG *jtag, u32 jtag_device_id);
 
+// the jtag it was given is left open
+void dap_free(DAP *dap);
+
+// Counters kept since dap_init().  Block transfers (dap_mem_read()
+// and the like) pick up again where they stopped after a WAIT, and
+// redo the group of blocks that failed after any other error, once
+// the DAP is recovered (abort, sticky bits cleared), a few times.
+typedef struct {
+	u64 waits;	// transfers picked up again after a WAIT
+	u64 retries;	// groups of blocks redone after an error
+	u64 recoveries;	// times the DAP was recovered from an error
+} DAP_STATS;
+
+void dap_get_stats(DAP *dap, DAP_STATS *stats);
+
 int dap_attach(DAP *dap);
 
 int dap_reset(DAP *dap);
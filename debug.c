@@ -35,7 +35,7 @@ static JTAG *jtag;
 // https://github.com/swetland/zynq-sandbox/blob/master/hdl/jtag_debug_port.sv
 
 void jconnect(void) {
-	if (jtag_mpsse_open(&jtag)) goto fail;
+	if (jtag_open(&jtag)) goto fail;
 	if (jtag_enumerate(jtag) < 0) goto fail;
 	if (jtag_select_by_family(jtag, "Xilinx 7")) goto fail;
 	return;
@@ -44,22 +44,46 @@ fail:
 	exit(1);
 }
 
-u32 jrd(u32 addr) {
+// The read and write sequences are recorded once, then replayed
+// with the address and data patched in.
+static JPROG *rdprog;
+static JPROG *wrprog;
+
+static JPROG *jrecord(int wr) {
 	u32 n = 0x23;
 	u64 u = 0;
+	JPROG *prog;
+	if (jtag_prog_begin(jtag)) goto fail;
 	jtag_ir_wr(jtag, 6, &n);
-	n = addr & 7;
-	jtag_dr_wr(jtag, 4, &n);
-	jtag_dr_rd(jtag, 36, &u);
+	if (wr) {
+		jtag_dr_wr(jtag, 36, &u);
+	} else {
+		jtag_dr_wr(jtag, 4, &n);
+		jtag_dr_rd(jtag, 36, &u);
+	}
+	if ((prog = jtag_prog_end(jtag)) == NULL) goto fail;
+	return prog;
+fail:
+	fprintf(stderr, "debug: cannot record jtag program\n");
+	exit(1);
+}
+
+u32 jrd(u32 addr) {
+	u32 n = addr & 7;
+	u64 u = 0;
+	if (rdprog == NULL) rdprog = jrecord(0);
+	jtag_prog_patch(jtag, rdprog, 1, &n);
+	jtag_prog_bind(jtag, rdprog, 2, &u);
+	jtag_prog_run(jtag, rdprog);
 	jtag_commit(jtag);
 	return (u32) u;
 }
 
 void jwr(u32 addr, u32 val) {
-	u32 n = 0x23;
 	u64 u = ((u64)val) | (((u64) (addr & 7)) << 32) | 0x800000000ULL;
-	jtag_ir_wr(jtag, 6, &n);
-	jtag_dr_wr(jtag, 36, &u);
+	if (wrprog == NULL) wrprog = jrecord(1);
+	jtag_prog_patch(jtag, wrprog, 1, &u);
+	jtag_prog_run(jtag, wrprog);
 	jtag_commit(jtag);
 }
 
@@ -275,7 +275,7 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (jtag_mpsse_open(&jtag)) return -1;
+	if (jtag_open(&jtag)) return -1;
 	if (jtag_enumerate(jtag) < 0) return -1;
 
 	return fpga_send_bitfile(jtag, data, sz);
@@ -78,6 +78,35 @@ typedef struct JREG {
 
 #define DEVMAX 32
 
+// a jtag_*() call recorded by a program, when the driver cannot
+// record the scans themselves
+#define CALL_GOTO	0
+#define CALL_IDLE	1
+#define CALL_WR		2
+#define CALL_RD		3
+#define CALL_IO		4
+
+typedef struct {
+	u32 op;
+	u32 count;
+	JREG *xr;
+	u8 *wbits; // owned copy
+	u8 *rbits;
+} JCALL;
+
+struct JPROG {
+	JCODE *code;
+	u32 enter;
+	u32 leave;
+	JCALL *call;
+	u32 ncalls;
+	u32 maxcalls;
+	u32 failed;
+	// clocks and scan bits each run of a driver program adds
+	u64 tcks;
+	u64 bits;
+};
+
 // configuration and state of JTAG
 struct JTAG {
 	JDRV *drv;
@@ -88,6 +117,31 @@ struct JTAG {
 
 	u32 state;
 
+	// TMS motion not yet handed to the driver: count clocks of
+	// bits (lsb first) with TDI held at obit, starting from pstart.
+	// The tail of a scan is held here so the moves that follow it
+	// can go out with it in a single scan_tms.  The first pkeep
+	// clocks must be kept, the rest may be rerouted by jtag_goto().
+	u32 pbits;
+	u32 pcount;
+	u32 pkeep;
+	u32 pobit;
+	u32 pstart;
+	u32 pioffset;
+	u8 *pibits;
+
+	// tickets handed out by the fallback jtag_submit()
+	u32 tickets;
+
+	// program being recorded, and whether by recording calls
+	JPROG *rec;
+	u32 rec_calls;
+
+	// counters that need no help from the driver, and the totals
+	// as of the last jtag_reset_stats()
+	JTAG_STATS stats;
+	JTAG_STATS stats_base;
+
 	int devcount;
 	JTAG_INFO devinfo[DEVMAX];
 };
@@ -97,14 +151,21 @@ struct JTAG {
 #define _commit() \
 	jtag->vt->commit(jtag->drv)
 #define _scan_tms(obit, count, tbits, ioffset, ibits) \
-	jtag->vt->scan_tms(jtag->drv, obit, count, tbits, ioffset, ibits)
+	(jtag->stats.tcks += (count), \
+	jtag->vt->scan_tms(jtag->drv, obit, count, tbits, ioffset, ibits))
 #define _scan_io(count, obits, ibits) \
-	jtag->vt->scan_io(jtag->drv, count, obits, ibits)
+	(jtag->stats.tcks += (count), \
+	jtag->vt->scan_io(jtag->drv, count, obits, ibits))
 #define _close() \
 	jtag->vt->close(jtag->drv)
+#define _prog_mark(count, wbits, rbits) \
+	if (jtag->rec) jtag->vt->prog_mark(jtag->drv, count, wbits, rbits)
 
 static u8 ONES[1024];
 
+static void jtag_plot_init(void);
+static void jtag_print_stats(JTAG *jtag);
+
 void jtag_clear_state(JTAG *jtag) {
 	jtag->ir.idlestate = JTAG_IDLE;
 	jtag->ir.scanstate = JTAG_IRSHIFT;
@@ -131,15 +192,36 @@ int jtag_init(JTAG **_jtag, JDRV *drv, JDVT *vt) {
 	jtag_clear_state(jtag);
 	*_jtag = jtag;
 	memset(ONES, 0xFF, sizeof(ONES));
+	jtag_plot_init();
 	return 0;
 }
 
+int jtag_open(JTAG **jtag) {
+	const char *fn;
+	if ((fn = getenv("JTAG_SIM")) != NULL) {
+		return jtag_sim_open(jtag, fn);
+	}
+	if ((fn = getenv("JTAG_REPLAY")) != NULL) {
+		return jtag_replay_open(jtag, fn);
+	}
+	if ((fn = getenv("JTAG_CAPTURE")) != NULL) {
+		return jtag_capture_open(jtag, fn);
+	}
+	return jtag_mpsse_open(jtag);
+}
+
 void jtag_close(JTAG *jtag) {
+	if (getenv("JTAG_STATS")) {
+		jtag_print_stats(jtag);
+	}
 	_close();
 	free(jtag);
 }
 
+static void jtag_flush(JTAG *jtag);
+
 int jtag_setspeed(JTAG *jtag, int khz) {
+	jtag_flush(jtag);
 	return _setspeed(khz);
 }
 
@@ -173,137 +255,273 @@ static u32 lastbit(const u8 *bits, u32 count) {
 	return (bits[count >> 3] >> (count & 7)) & 1;
 }
 
+#if TRACE_STATEMACHINE
 static const char *JSTATE[16] = {
 	"RESET", "IDLE", "DRSELECT", "DRCAPTURE",
 	"DRSHIFT", "DREXIT1", "DRPAUSE", "DREXIT2",
 	"DRUPDATE", "IRSELECT", "IRCAPTURE", "IRSHIFT",
-	"IREXIT1", "IRPAUSE", "IREXIT1", "IRUPDATE"
+	"IREXIT1", "IRPAUSE", "IREXIT2", "IRUPDATE"
+};
+#endif
+
+// next state for each state, with TMS low and TMS high
+static const u8 JNEXT[16][2] = {
+	[JTAG_RESET] = { JTAG_IDLE, JTAG_RESET },
+	[JTAG_IDLE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_DRSELECT] = { JTAG_DRCAPTURE, JTAG_IRSELECT },
+	[JTAG_DRCAPTURE] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DRSHIFT] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DREXIT1] = { JTAG_DRPAUSE, JTAG_DRUPDATE },
+	[JTAG_DRPAUSE] = { JTAG_DRPAUSE, JTAG_DREXIT2 },
+	[JTAG_DREXIT2] = { JTAG_DRSHIFT, JTAG_DRUPDATE },
+	[JTAG_DRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_IRSELECT] = { JTAG_IRCAPTURE, JTAG_RESET },
+	[JTAG_IRCAPTURE] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IRSHIFT] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IREXIT1] = { JTAG_IRPAUSE, JTAG_IRUPDATE },
+	[JTAG_IRPAUSE] = { JTAG_IRPAUSE, JTAG_IREXIT2 },
+	[JTAG_IREXIT2] = { JTAG_IRSHIFT, JTAG_IRUPDATE },
+	[JTAG_IRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
 };
 
-#define JPATH(x,c) { static u8 out = x; *bits = &out; return c; }
+// shortest TMS sequence (lsb first) between every pair of states
+// the longest is 8 clocks (DRCAPTURE to IREXIT2; DRPAUSE to IRPAUSE
+// is 7), so each fits in a u8.  jtag_move() runs paths together up to
+// 16 clocks before handing them to scan_tms, so this relies on
+// drivers taking up to 16 clocks a call, as jtag-driver.h promises.
+static u8 JPATHBITS[16][16];
+static u8 JPATHCOUNT[16][16];
+
+static void jtag_plot_init(void) {
+	u8 queue[16];
+	u32 from, head, tail, s, t, tms;
+	for (from = 0; from < 16; from++) {
+		memset(JPATHCOUNT[from], 0xFF, 16);
+		JPATHCOUNT[from][from] = 0;
+		JPATHBITS[from][from] = 0;
+		// breadth first, so the first path to reach a state is shortest
+		queue[0] = from;
+		for (head = 0, tail = 1; head < tail; head++) {
+			s = queue[head];
+			for (tms = 0; tms < 2; tms++) {
+				t = JNEXT[s][tms];
+				if (JPATHCOUNT[from][t] != 0xFF)
+					continue;
+				JPATHCOUNT[from][t] = JPATHCOUNT[from][s] + 1;
+				JPATHBITS[from][t] = JPATHBITS[from][s] |
+					(tms << JPATHCOUNT[from][s]);
+				queue[tail++] = t;
+			}
+		}
+	}
+	// five ones reach RESET from anywhere, even if we are out
+	// of sync with the TAP, so always use the full sequence
+	// (plus one for good measure, as before)
+	for (from = 0; from < 16; from++) {
+		JPATHBITS[from][JTAG_RESET] = 0x3F;
+		JPATHCOUNT[from][JTAG_RESET] = 6;
+	}
+}
 
 static u32 jtag_plot(u32 from, u32 to, u8 **bits) {
 #if TRACE_STATEMACHINE
 	fprintf(stderr,"jtag_plot: move from %s to %s\n",
 			JSTATE[from], JSTATE[to]);
 #endif
-	switch (from) {
-	case JTAG_RESET:
-		if (to == JTAG_IDLE) JPATH(0x00, 1); // 0
-		if (to == JTAG_IRSHIFT) JPATH(0x06, 5); // 01100
-		if (to == JTAG_DRSHIFT) JPATH(0x02, 4); // 0100
-		break;
-	case JTAG_IDLE:
-		if (to == JTAG_IRSHIFT) JPATH(0x03, 4); // 1100
-		if (to == JTAG_DRSHIFT) JPATH(0x01, 3); // 100
-		break;
-	case JTAG_IRSHIFT:
-		if (to == JTAG_IDLE) JPATH(0x03, 3); // 110
-		if (to == JTAG_IRPAUSE) JPATH(0x01, 2); // 10
-		break;
-	case JTAG_DRSHIFT:
-		if (to == JTAG_IDLE) JPATH(0x03, 3); // 110
-		if (to == JTAG_DRPAUSE) JPATH(0x01, 2); // 10
-		break;
-	case JTAG_IRPAUSE:
-		if (to == JTAG_IDLE) JPATH(0x03, 3); // 110
-		if (to == JTAG_IRSHIFT) JPATH(0x01, 2); // 10
-		if (to == JTAG_DRSHIFT) JPATH(0x07, 5); // 11100
-		break;
-	case JTAG_DRPAUSE:
-		if (to == JTAG_IDLE) JPATH(0x03, 3); // 110
-		if (to == JTAG_DRSHIFT) JPATH(0x01, 2); // 10
-		if (to == JTAG_IRSHIFT) JPATH(0x0F, 6); // 111100
-		break;
-	}
-	if (to == JTAG_RESET) JPATH(0x3F, 6); // 111111
-
-	if (from == to) return 0;
-
-	fprintf(stderr,"jtag_plot: cannot move from %s to %s\n",
-			JSTATE[from], JSTATE[to]);
-	return 0;
+	*bits = &JPATHBITS[from & 15][to & 15];
+	if ((from > 15) || (to > 15)) {
+		fprintf(stderr,"jtag_plot: invalid move from %u to %u\n",
+			(unsigned) from, (unsigned) to);
+		return 0;
+	}
+	return JPATHCOUNT[from][to];
 };
 
+// hand any pending TMS motion to the driver
+static void jtag_flush(JTAG *jtag) {
+	u8 bits[2];
+	if (jtag->pcount == 0) {
+		return;
+	}
+	bits[0] = jtag->pbits;
+	bits[1] = jtag->pbits >> 8;
+	_scan_tms(jtag->pobit, jtag->pcount, bits, jtag->pioffset, jtag->pibits);
+	jtag->pbits = 0;
+	jtag->pcount = 0;
+	jtag->pkeep = 0;
+	jtag->pobit = 0;
+	jtag->pibits = 0;
+}
+
+// append count clocks of TMS motion to the pending motion
+static void jtag_move(JTAG *jtag, u32 count, u32 bits) {
+	if ((jtag->pcount + count) > 16) {
+		jtag_flush(jtag);
+	}
+	if (jtag->pcount == 0) {
+		jtag->pstart = jtag->state;
+	}
+	jtag->pbits |= bits << jtag->pcount;
+	jtag->pcount += count;
+	jtag->pkeep = jtag->pcount;
+}
+
+// The pending tail of a scan only has to get through UPDATE.  If the
+// next move is elsewhere, leave its path there rather than passing
+// through the idle state first (eg DRUPDATE -> DRSELECT).
+static void jtag_reroute(JTAG *jtag, u32 to) {
+	u32 k, cost, s = jtag->pstart;
+	u32 best = jtag->pcount;
+	u32 bstate = jtag->state;
+	u8 *mbits;
+	u32 bcost = best + jtag_plot(bstate, to, &mbits);
+	for (k = 0; k < jtag->pcount; k++) {
+		if (k >= jtag->pkeep) {
+			cost = k + jtag_plot(s, to, &mbits);
+			if (cost < bcost) {
+				best = k;
+				bcost = cost;
+				bstate = s;
+			}
+		}
+		s = JNEXT[s][(jtag->pbits >> k) & 1];
+	}
+	jtag->pcount = best;
+	jtag->pbits &= (1 << best) - 1;
+	jtag->pkeep = best;
+	jtag->state = bstate;
+}
+
+static int jtag_rec_call(JTAG *jtag, u32 op, u32 count, JREG *xr, u8 *wbits, u8 *rbits);
+
 void jtag_goto(JTAG *jtag, unsigned state) {
 	u32 mcount;
 	u8 *mbits;
+	if (jtag->rec_calls) {
+		jtag_rec_call(jtag, CALL_GOTO, state, 0, 0, 0);
+		return;
+	}
+	if (jtag->pkeep < jtag->pcount) {
+		jtag_reroute(jtag, state);
+	}
 	mcount = jtag_plot(jtag->state, state, &mbits);
 	if (mcount != 0) {
-		_scan_tms(0, mcount, mbits, 0, 0);
+		jtag_move(jtag, mcount, *mbits);
 		jtag->state = state;
 	}
 }
 
 void jtag_idle(JTAG *jtag, unsigned count) {
-	unsigned zero = 0;
+	if (jtag->rec_calls) {
+		jtag_rec_call(jtag, CALL_IDLE, count, 0, 0, 0);
+		return;
+	}
 	jtag_goto(jtag, JTAG_IDLE);
+	// TMS is low now, so long waits can just run the clock
+	if ((count > 16) && jtag->vt->clock) {
+		jtag_flush(jtag);
+		jtag->stats.tcks += count;
+		jtag->vt->clock(jtag->drv, count);
+		return;
+	}
 	while (count > 0) {
-		if (count > 6) {
-			_scan_tms(0, 6, (void*) &zero, 0, 0);
-			count -= 6;
+		if (count > 8) {
+			jtag_move(jtag, 8, 0);
+			count -= 8;
 		} else {
-			_scan_tms(0, count, (void*) &zero, 0, 0);
+			jtag_move(jtag, count, 0);
 			count = 0;
 		}
 	}
 }
 
-static void jtag_xr_wr(JTAG *jtag, JREG *xr, u32 count, u8 *wbits) {
-	u32 mcount;
+// leave the scan state: the first clock shifts the last bit (obit),
+// capturing its TDO if ibits is nonnull, then on to the idle state
+static void jtag_xr_exit(JTAG *jtag, JREG *xr, u32 obit, u32 ioffset, u8 *ibits) {
+	u32 mcount, k, s;
 	u8 *mbits;
-	jtag_goto(jtag, xr->scanstate);
 	mcount = jtag_plot(xr->scanstate, xr->idlestate, &mbits);
+	jtag_flush(jtag);
+	jtag->state = xr->scanstate;
+	jtag_move(jtag, mcount, *mbits);
+	jtag->pobit = obit;
+	jtag->pioffset = ioffset;
+	jtag->pibits = ibits;
+	jtag->state = xr->idlestate;
+	// the clocks through UPDATE must happen, the rest are negotiable
+	for (k = 0, s = xr->scanstate; k < mcount; k++) {
+		s = JNEXT[s][(*mbits >> k) & 1];
+		if ((s == JTAG_DRUPDATE) || (s == JTAG_IRUPDATE)) {
+			jtag->pkeep = k + 1;
+			break;
+		}
+	}
+}
+
+static void jtag_xr_wr(JTAG *jtag, JREG *xr, u32 count, u8 *wbits) {
+	if (jtag->rec_calls) {
+		jtag_rec_call(jtag, CALL_WR, count, xr, wbits, 0);
+		return;
+	}
+	jtag->stats.bits += count;
+	jtag_goto(jtag, xr->scanstate);
+	jtag_flush(jtag);
 	if (xr->prebits) {
 		_scan_io(xr->precount, xr->prebits, 0);
 	}
+	_prog_mark(count, wbits, 0);
 	if (xr->postbits) {
 		_scan_io(count, wbits, 0);
 		_scan_io(xr->postcount - 1, xr->postbits, 0);
-		_scan_tms(lastbit(xr->postbits, xr->postcount), mcount, mbits, 0, 0);
+		jtag_xr_exit(jtag, xr, lastbit(xr->postbits, xr->postcount), 0, 0);
 	} else {
 		_scan_io(count - 1, wbits, 0);
-		_scan_tms(lastbit(wbits, count), mcount, mbits, 0, 0);
+		jtag_xr_exit(jtag, xr, lastbit(wbits, count), 0, 0);
 	}
-	jtag->state = xr->idlestate;
 }
 
 static void jtag_xr_rd(JTAG *jtag, JREG *xr, u32 count, u8 *rbits) {
-	u32 mcount;
-	u8 *mbits;
+	if (jtag->rec_calls) {
+		jtag_rec_call(jtag, CALL_RD, count, xr, 0, rbits);
+		return;
+	}
+	jtag->stats.bits += count;
 	jtag_goto(jtag, xr->scanstate);
-	mcount = jtag_plot(xr->scanstate, xr->idlestate, &mbits);
+	jtag_flush(jtag);
 	if (xr->prebits) {
 		_scan_io(xr->precount, xr->prebits, 0);
 	}
+	_prog_mark(count, 0, rbits);
 	if (xr->postbits) {
 		_scan_io(count, 0, rbits);
 		_scan_io(xr->postcount - 1, xr->postbits, 0);
-		_scan_tms(lastbit(xr->postbits, xr->postcount), mcount, mbits, 0, 0);
+		jtag_xr_exit(jtag, xr, lastbit(xr->postbits, xr->postcount), 0, 0);
 	} else {
 		_scan_io(count - 1, 0, rbits);
-		_scan_tms(0, mcount, mbits, count - 1, rbits);
+		jtag_xr_exit(jtag, xr, 0, count - 1, rbits);
 	}
-	jtag->state = xr->idlestate;
 }
 
 static void jtag_xr_io(JTAG *jtag, JREG *xr, u32 count, u8 *wbits, u8 *rbits) {
-	u32 mcount;
-	u8 *mbits;
+	if (jtag->rec_calls) {
+		jtag_rec_call(jtag, CALL_IO, count, xr, wbits, rbits);
+		return;
+	}
+	jtag->stats.bits += count;
 	jtag_goto(jtag, xr->scanstate);
-	mcount = jtag_plot(xr->scanstate, xr->idlestate, &mbits);
+	jtag_flush(jtag);
 	if (xr->prebits) {
 		_scan_io(xr->precount, xr->prebits, 0);
 	}
+	_prog_mark(count, wbits, rbits);
 	if (xr->postbits) {
 		_scan_io(count, (void*) wbits, rbits);
 		_scan_io(xr->postcount - 1, xr->postbits, 0);
-		_scan_tms(lastbit(xr->postbits, xr->postcount), mcount, mbits, 0, 0);
+		jtag_xr_exit(jtag, xr, lastbit(xr->postbits, xr->postcount), 0, 0);
 	} else {
 		_scan_io(count - 1, (void*) wbits, rbits);
-		_scan_tms(lastbit(wbits, count), mcount, mbits, count - 1, rbits);
+		jtag_xr_exit(jtag, xr, lastbit(wbits, count), count - 1, rbits);
 	}
-	jtag->state = xr->idlestate;
 }
 
 void jtag_ir_wr(JTAG *jtag, unsigned count, const void *wbits) {
@@ -327,9 +545,279 @@ void jtag_dr_io(JTAG *jtag, unsigned count, const void *wbits, void *rbits) {
 }
 
 int jtag_commit(JTAG *jtag) {
+	if (jtag->rec) {
+		fprintf(stderr, "jtag: cannot commit while recording\n");
+		return -1;
+	}
+	jtag_flush(jtag);
+	jtag->stats.commits++;
 	return _commit();
 }
 
+int jtag_submit(JTAG *jtag, unsigned *ticket) {
+	u32 t;
+	if (jtag->rec) {
+		fprintf(stderr, "jtag: cannot submit while recording\n");
+		return -1;
+	}
+	jtag_flush(jtag);
+	jtag->stats.commits++;
+	if (jtag->vt->submit == 0) {
+		// drivers that cannot overlap just complete it now
+		*ticket = ++jtag->tickets;
+		return _commit();
+	}
+	if (jtag->vt->submit(jtag->drv, &t)) {
+		return -1;
+	}
+	*ticket = t;
+	return 0;
+}
+
+int jtag_wait(JTAG *jtag, unsigned ticket) {
+	if (jtag->vt->wait == 0) {
+		return 0;
+	}
+	return (jtag->vt->wait(jtag->drv, ticket, 1) < 0) ? -1 : 0;
+}
+
+int jtag_wait_all(JTAG *jtag, const unsigned *ticket, int count) {
+	int n, r = 0;
+	for (n = 0; n < count; n++) {
+		if (jtag_wait(jtag, ticket[n])) {
+			r = -1;
+		}
+	}
+	return r;
+}
+
+int jtag_poll(JTAG *jtag, unsigned ticket) {
+	if (jtag->vt->wait == 0) {
+		return 1;
+	}
+	return jtag->vt->wait(jtag->drv, ticket, 0);
+}
+
+static void jtag_total_stats(JTAG *jtag, JTAG_STATS *stats) {
+	*stats = jtag->stats;
+	if (jtag->vt->stats) {
+		jtag->vt->stats(jtag->drv, stats);
+	}
+}
+
+void jtag_get_stats(JTAG *jtag, JTAG_STATS *stats) {
+	// every counter is a u64
+	u64 *x = (u64*) stats;
+	u64 *base = (u64*) &jtag->stats_base;
+	u32 n;
+	jtag_total_stats(jtag, stats);
+	for (n = 0; n < (sizeof(JTAG_STATS) / sizeof(u64)); n++) {
+		x[n] -= base[n];
+	}
+}
+
+void jtag_reset_stats(JTAG *jtag) {
+	jtag_total_stats(jtag, &jtag->stats_base);
+}
+
+static void jtag_print_stats(JTAG *jtag) {
+	JTAG_STATS s;
+	jtag_get_stats(jtag, &s);
+	fprintf(stderr, "jtag: %llu commits (%llu implicit), %llu TCKs, %llu scan bits\n"
+		"jtag: %llu bytes out, %llu in, %llu+%llu usb transfers, %llu.%03llu ms blocked\n",
+		(unsigned long long) s.commits, (unsigned long long) s.implicit,
+		(unsigned long long) s.tcks, (unsigned long long) s.bits,
+		(unsigned long long) s.tx_bytes, (unsigned long long) s.rx_bytes,
+		(unsigned long long) s.usb_out, (unsigned long long) s.usb_in,
+		(unsigned long long) (s.wait_ns / 1000000),
+		(unsigned long long) ((s.wait_ns / 1000) % 1000));
+}
+
+static int jtag_rec_call(JTAG *jtag, u32 op, u32 count, JREG *xr, u8 *wbits, u8 *rbits) {
+	JPROG *prog = jtag->rec;
+	JCALL *call;
+	u32 bytes = (count + 7) >> 3;
+	if (prog->ncalls == prog->maxcalls) {
+		prog->maxcalls = prog->maxcalls ? (prog->maxcalls * 2) : 32;
+		call = realloc(prog->call, prog->maxcalls * sizeof(JCALL));
+		if (call == 0) {
+			prog->failed = 1;
+			return -1;
+		}
+		prog->call = call;
+	}
+	call = prog->call + prog->ncalls;
+	call->op = op;
+	call->count = count;
+	call->xr = xr;
+	call->wbits = 0;
+	call->rbits = rbits;
+	if (wbits) {
+		if ((call->wbits = malloc(bytes)) == 0) {
+			prog->failed = 1;
+			return -1;
+		}
+		memcpy(call->wbits, wbits, bytes);
+	}
+	prog->ncalls++;
+	return 0;
+}
+
+static JCALL *jtag_prog_scan(JPROG *prog, u32 n) {
+	u32 i, k = n;
+	for (i = 0; i < prog->ncalls; i++) {
+		if (prog->call[i].op < CALL_WR) {
+			continue;
+		}
+		if (k-- == 0) {
+			return prog->call + i;
+		}
+	}
+	fprintf(stderr, "jtag: program has no scan %u\n", (unsigned) n);
+	return NULL;
+}
+
+int jtag_prog_begin(JTAG *jtag) {
+	JPROG *prog;
+	if (jtag->rec) {
+		fprintf(stderr, "jtag: already recording\n");
+		return -1;
+	}
+	if ((prog = malloc(sizeof(JPROG))) == 0) {
+		return -1;
+	}
+	memset(prog, 0, sizeof(JPROG));
+	jtag_flush(jtag);
+	prog->enter = jtag->state;
+	prog->tcks = jtag->stats.tcks;
+	prog->bits = jtag->stats.bits;
+	if (jtag->vt->prog_begin) {
+		if (jtag->vt->prog_begin(jtag->drv)) {
+			free(prog);
+			return -1;
+		}
+	} else {
+		jtag->rec_calls = 1;
+	}
+	jtag->rec = prog;
+	return 0;
+}
+
+JPROG *jtag_prog_end(JTAG *jtag) {
+	JPROG *prog = jtag->rec;
+	if (prog == 0) {
+		fprintf(stderr, "jtag: not recording\n");
+		return NULL;
+	}
+	if (jtag->rec_calls) {
+		jtag->rec_calls = 0;
+		jtag->rec = 0;
+	} else {
+		// the tail of the last scan belongs to the program
+		jtag_flush(jtag);
+		jtag->rec = 0;
+		prog->leave = jtag->state;
+		if ((prog->code = jtag->vt->prog_end(jtag->drv)) == 0) {
+			prog->failed = 1;
+		}
+		// nor was it clocked: runs of the program count it instead
+		prog->tcks = jtag->stats.tcks - prog->tcks;
+		prog->bits = jtag->stats.bits - prog->bits;
+		jtag->stats.tcks -= prog->tcks;
+		jtag->stats.bits -= prog->bits;
+		// nothing recorded was sent, so the TAP is where we began
+		jtag->state = prog->enter;
+	}
+	if (prog->failed) {
+		fprintf(stderr, "jtag: cannot record program\n");
+		jtag_prog_free(jtag, prog);
+		return NULL;
+	}
+	return prog;
+}
+
+int jtag_prog_run(JTAG *jtag, JPROG *prog) {
+	JCALL *call;
+	u32 n;
+	if (jtag->rec) {
+		fprintf(stderr, "jtag: cannot run a program while recording\n");
+		return -1;
+	}
+	if (prog->code == 0) {
+		for (n = 0, call = prog->call; n < prog->ncalls; n++, call++) {
+			switch (call->op) {
+			case CALL_GOTO:
+				jtag_goto(jtag, call->count);
+				break;
+			case CALL_IDLE:
+				jtag_idle(jtag, call->count);
+				break;
+			case CALL_WR:
+				jtag_xr_wr(jtag, call->xr, call->count, call->wbits);
+				break;
+			case CALL_RD:
+				jtag_xr_rd(jtag, call->xr, call->count, call->rbits);
+				break;
+			case CALL_IO:
+				jtag_xr_io(jtag, call->xr, call->count, call->wbits, call->rbits);
+				break;
+			}
+		}
+		return 0;
+	}
+	if (jtag->state != prog->enter) {
+		jtag_goto(jtag, prog->enter);
+	}
+	jtag_flush(jtag);
+	if (jtag->vt->prog_run(jtag->drv, prog->code)) {
+		return -1;
+	}
+	jtag->stats.tcks += prog->tcks;
+	jtag->stats.bits += prog->bits;
+	jtag->state = prog->leave;
+	return 0;
+}
+
+int jtag_prog_patch(JTAG *jtag, JPROG *prog, unsigned n, const void *wbits) {
+	JCALL *call;
+	if (prog->code) {
+		return jtag->vt->prog_patch(jtag->drv, prog->code, n, wbits);
+	}
+	if ((call = jtag_prog_scan(prog, n)) == NULL) {
+		return -1;
+	}
+	if (call->wbits) {
+		memcpy(call->wbits, wbits, (call->count + 7) >> 3);
+	}
+	return 0;
+}
+
+int jtag_prog_bind(JTAG *jtag, JPROG *prog, unsigned n, void *rbits) {
+	JCALL *call;
+	if (prog->code) {
+		return jtag->vt->prog_bind(jtag->drv, prog->code, n, rbits);
+	}
+	if ((call = jtag_prog_scan(prog, n)) == NULL) {
+		return -1;
+	}
+	if (call->rbits) {
+		call->rbits = rbits;
+	}
+	return 0;
+}
+
+void jtag_prog_free(JTAG *jtag, JPROG *prog) {
+	u32 n;
+	if (prog->code) {
+		jtag->vt->prog_free(jtag->drv, prog->code);
+	}
+	for (n = 0; n < prog->ncalls; n++) {
+		free(prog->call[n].wbits);
+	}
+	free(prog->call);
+	free(prog);
+}
+
 int jtag_enumerate(JTAG *jtag) {
 	JTAG_INFO *info;
 	u32 data[DEVMAX];
@@ -369,6 +857,90 @@ int jtag_enumerate(JTAG *jtag) {
 	return -1;
 }
 
+// speeds to try when calibrating, slowest first
+static const int CALSPEED[] = {
+	1000, 2000, 3000, 5000, 7500, 10000, 15000, 30000,
+};
+
+#define CALWORDS 16
+
+// shift a pattern through the IDCODE registers, check it comes back
+static int jtag_check_chain(JTAG *jtag) {
+	u32 tx[DEVMAX + CALWORDS];
+	u32 rx[DEVMAX + CALWORDS];
+	u32 n, x = 0xACE1ACE1;
+	int count = jtag->devcount;
+
+	for (n = 0; n < (count + CALWORDS); n++) {
+		// alternate fixed edges with an lfsr sequence
+		switch (n & 3) {
+		case 0: tx[n] = 0x55555555; break;
+		case 1: tx[n] = 0x00FF00FF; break;
+		default:
+			x = (x >> 1) ^ ((-(x & 1)) & 0xD0000001);
+			tx[n] = x;
+		}
+	}
+	memset(rx, 0, sizeof(rx));
+	jtag_goto(jtag, JTAG_RESET);
+	jtag_dr_io(jtag, (count + CALWORDS) * 32, tx, rx);
+	if (jtag_commit(jtag)) {
+		return -1;
+	}
+	for (n = 0; n < count; n++) {
+		if ((rx[n] & jtag->devinfo[n].idmask) != jtag->devinfo[n].idcode) {
+			return -1;
+		}
+	}
+	for (n = 0; n < CALWORDS; n++) {
+		if (rx[count + n] != tx[n]) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int jtag_calibrate(JTAG *jtag, int maxkhz) {
+	int best = -1;
+	int khz, n, i;
+
+	if (_setspeed(CALSPEED[0]) < 0) {
+		return -1;
+	}
+	if (jtag_enumerate(jtag) < 0) {
+		fprintf(stderr, "jtag: cannot calibrate, enumeration failed\n");
+		return -1;
+	}
+	for (n = 0; n < (sizeof(CALSPEED)/sizeof(CALSPEED[0])); n++) {
+		if (CALSPEED[n] > maxkhz) {
+			break;
+		}
+		if ((khz = _setspeed(CALSPEED[n])) < 0) {
+			break;
+		}
+		if (khz == best) {
+			// hardware cannot go any faster
+			break;
+		}
+		for (i = 0; i < 8; i++) {
+			if (jtag_check_chain(jtag)) {
+				break;
+			}
+		}
+		if (i != 8) {
+			break;
+		}
+		best = khz;
+	}
+	if (best < 0) {
+		fprintf(stderr, "jtag: no reliable speed found\n");
+		_setspeed(CALSPEED[0]);
+		return -1;
+	}
+	fprintf(stderr, "jtag: calibrated to %d kHz\n", best);
+	return _setspeed(best);
+}
+
 void jtag_print_chain(JTAG *jtag) {
 	int n;
 	for (n = 0; n < jtag->devcount; n++) {
@@ -18,6 +18,7 @@
 #include "jtag.h"
 
 typedef struct JDRV JDRV;
+typedef struct JCODE JCODE;
 
 typedef struct {
 	int (*init)(JDRV *d);
@@ -30,8 +31,17 @@ typedef struct {
 // Once this returns, pointers passed via scan_*() may become invalid.
 	int (*commit)(JDRV *d);
 
+// Optional: declare the end of a transaction, but do not wait for it.
+// Transactions complete in order.  *ticket identifies this one.
+	int (*submit)(JDRV *d, u32 *ticket);
+// Returns 1 once the transaction with ticket has completed, 0 if it has
+// not yet and block is 0, negative on error.  Once it has completed,
+// pointers passed via scan_*() before it was submitted may become invalid.
+	int (*wait)(JDRV *d, u32 ticket, int block);
+
 // Shift count TMS=tbits TDI=obit out.
 // If ibits is nonnull, capture the first TDO at offset ioffset in ibits.
+// count is at most 16 (tbits lsb first), enough for any TAP state path.
 	int (*scan_tms)(JDRV *d, u32 obit, u32 count, u8 *tbits,
 			u32 ioffset, u8 *ibits);
 
@@ -41,12 +51,39 @@ typedef struct {
 // TMS does not change.
 	int (*scan_io)(JDRV *d, u32 count, u8 *obits, u8 *ibits);
 
+// Optional: clock count cycles with TMS and TDI left as they are.
+	int (*clock)(JDRV *d, u32 count);
+
 // Close and release driver.
 	int (*close)(JDRV *d);
+
+// Recorded programs.  Optional: if prog_begin is NULL, jtag-core
+// records and replays the jtag_*() calls themselves instead.
+// Between prog_begin() and prog_end(), scans are encoded into a
+// program rather than queued.
+	int (*prog_begin)(JDRV *d);
+// The next count TDI bits (from wbits, if nonnull) are the data of a
+// scan that may be patched later.  Its TDO bits are captured to rbits.
+	void (*prog_mark)(JDRV *d, u32 count, u8 *wbits, u8 *rbits);
+// Returns NULL on error.
+	JCODE *(*prog_end)(JDRV *d);
+// Queue the program, as if its scans had been issued again.
+	int (*prog_run)(JDRV *d, JCODE *code);
+// Replace the TDI data of the nth marked scan, or redirect its TDO data.
+	int (*prog_patch)(JDRV *d, JCODE *code, u32 n, const u8 *wbits);
+	int (*prog_bind)(JDRV *d, JCODE *code, u32 n, u8 *rbits);
+	void (*prog_free)(JDRV *d, JCODE *code);
+
+// Optional: fill in the counters only the driver knows (tx_bytes on),
+// as totals since the driver was opened.
+	void (*stats)(JDRV *d, JTAG_STATS *stats);
 } JDVT;
 
 int jtag_init(JTAG **jtag, JDRV *drv, JDVT *vt);
 
+// open the mpsse driver without a JTAG around it (for interposers)
+int jtag_mpsse_create(JDRV **drv, JDVT **vt);
+
 #endif
 
 
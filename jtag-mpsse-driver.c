@@ -17,14 +17,25 @@
 #include <string.h>
 
 #include "jtag-driver.h"
+#include "jtag-trace.h"
 
-// USB bulk xfer fails trying to queue > 8192...
-#define CMD_MAX (8*1024)
+// USB bulk xfer fails trying to queue > 8192 out, so no OUT transfer
+// we submit, command or direct, is larger than XFER_MAX.
+#define XFER_MAX (8*1024)
 
-#define TRACE_IO 0 
-#define TRACE_DIS 0 
-#define TRACE_USB 0 
-#define TRACE_TXN 0
+#define CMD_MAX XFER_MAX
+
+// largest multi-packet read we queue at once
+#define RX_MAX (64*1024)
+
+// Byte scans at least this large are sent straight from (and read
+// straight into) the caller's buffers rather than copied through cmd[].
+#define ZC_MIN (4*1024)
+
+// most bytes a single direct byte-shift command moves: the data it
+// sends is its own bulk transfer out, while a read-only one sends
+// just the header and may read up to RX_MAX straight in
+#define ZC_MAX XFER_MAX
 
 // FTDI MPSSE Device Info
 static struct {
@@ -41,24 +52,31 @@ static struct {
 
 static unsigned char mpsse_init[] = {
 	0x85, // loopback off
-	0x8a, // disable clock/5
-	0x86, 0x01, 0x00, // set divisor
 	0x80, 0xe8, 0xeb, // set low state and dir
 	0x82, 0x00, 0x00, // set high state and dir
 };
 
-static void dump(char *prefix, void *data, int len) {
-	unsigned char *x = data;
-	fprintf(stderr,"%s: (%d)", prefix, len);
-	while (len > 0) {
-		fprintf(stderr," %02x", *x++);
-		len--;
-	}
-	fprintf(stderr,"\n");
-}
+// TCK used until someone asks for something else
+#define DEFAULT_KHZ 15000
+
+// FTDI chip type, from the device descriptor's bcdDevice
+#define FTDI_TYPE_2232C		0x0500
+#define FTDI_TYPE_2232H		0x0700
+#define FTDI_TYPE_4232H		0x0800
+#define FTDI_TYPE_232H		0x0900
 
 #include <libusb-1.0/libusb.h>
 
+#include <time.h>
+static u64 NOW(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) return 0;
+	return (((u64) ts.tv_sec) * ((u64)1000000000)) + ((u64) ts.tv_nsec);
+}
+
+// give up if the device owes us data but sends none for this long (ns)
+#define RX_TIMEOUT 1000000000ULL
+
 // how to process the reply buffer
 #define OP_END		0 // done
 #define OP_BITS		1 // copy top n (1-8) bits to ptr
@@ -72,36 +90,223 @@ typedef struct {
 	u16 x;
 } JOP;
 
+// Number of command buffers that may be queued to the device at once.
+// While some are in flight (or their replies are draining), the next
+// is assembled.
+#define TXN_MAX 4
+
+// A piece of the outgoing or incoming stream: either part of a txn's
+// cmd/reply buffer or part of a caller's buffer.
+typedef struct {
+	u8 *ptr;
+	u32 len;
+} JSEG;
+
+#define SEG_MAX 32
+
+// A command buffer and the ops describing how to process its reply.
+// The outgoing stream is tx[0..txsegs), each sent as its own transfer.
+// The reply stream fills rx[0..rxsegs) in order.
+typedef struct {
+	JDRV *d;
+	struct libusb_transfer *usb[SEG_MAX];
+	u32 busy; // submitted, reply not yet processed
+	u32 sending; // transfers still in flight
+	u32 expected;
+	u32 received;
+	u32 txsegs;
+	u32 rxsegs;
+	u32 rxseg; // reply segment currently being filled
+	u32 rxoff;
+	JSEG tx[SEG_MAX];
+	JSEG rx[SEG_MAX];
+	u8 cmd[CMD_MAX];
+	u8 reply[CMD_MAX];
+	JOP op[8192];
+} JTXN;
+
+// Where TDI bits of a recorded scan live in a program's commands:
+// n bits, from bit offset bit of the scan's data, at cmd[at] from
+// bit shift on (0 for shift payloads, 7 for a tms command's tdi bit).
+typedef struct {
+	u32 site;
+	u32 bit;
+	u32 at;
+	u16 n;
+	u16 shift;
+} JPATCH;
+
+// a recorded scan: its reads are op[op0..op1), landing relative to rbits
+typedef struct {
+	u8 *rbits;
+	u32 op0;
+	u32 op1;
+} JSITE;
+
+#define SITE_MAX 256
+#define PATCH_MAX 1024
+
+// A recorded program: pre-encoded commands, and the ops to decode its reply.
+struct JCODE {
+	u32 len;
+	u32 nops;
+	u32 replied;
+	u32 nsites;
+	u32 npatches;
+	u8 *cmd;
+	JOP *op;
+	JSITE *site;
+	JPATCH *patch;
+};
+
 struct JDRV {
 	struct libusb_device_handle *udev;
 	u8 ep_in;
 	u8 ep_out;
+	u16 type;
+	u32 pktsize;
 	int speed;
 	u32 expected;
-	u32 status;
+	int status;
 	u8 *next;
 	JOP *nextop;
-	u32 read_count;
-	u32 read_size;
-	u8 *read_ptr;
-	u8 cmd[CMD_MAX];
-	JOP op[8192];
-	u8 read_buffer[512];
+	u8 *seg; // start of the current tx segment in cmd[]
+	u32 replied; // bytes of reply[] in use
+
+	// command buffers, used round-robin:
+	// fill is being assembled, done is the oldest not yet retired
+	JTXN *txn[TXN_MAX];
+	u32 fill;
+	u32 done;
+
+	// txns submitted and retired so far, which serve as tickets,
+	// and the range of tickets (lo, hi] lost to the last error
+	u32 queued;
+	u32 retired;
+	u32 lost_lo;
+	u32 lost_hi;
+
+	// runtime trace (see jtag-trace.h), if JTAG_TRACE is set
+	JTRACE *trace;
+
+	// for jtag_get_stats(): txns are all those queued, explicit
+	// those queued by a commit or submit
+	u64 tx_bytes;
+	u64 rx_bytes;
+	u64 usb_out;
+	u64 usb_in;
+	u64 txns;
+	u64 explicit;
+	u64 wait_ns;
+
+	// reply bytes owed by the device for submitted txns
+	u32 rx_pending;
+	u32 rx_busy;
+	u64 rx_stall;
+	struct libusb_transfer *rx_usb;
+	u8 read_buffer[RX_MAX];
+
+	// recording a program: it is assembled in the fill txn
+	// from cmd[0] and op[0], and copied out at prog_end
+	u32 rec;
+	u32 rec_left; // tdi bits of the current site still to come
+	u32 rec_bit;
+	u32 rec_nsites;
+	u32 rec_npatches;
+	JSITE rec_site[SITE_MAX];
+	JPATCH rec_patch[PATCH_MAX];
 };
 
+#define TRACE(type, data, len) \
+	if (d->trace) jtrace_add(d->trace, type, data, len)
+
 static inline u32 cmd_avail(JDRV *d) {
-	return CMD_MAX - (d->next - d->cmd);
+	return CMD_MAX - (d->next - d->txn[d->fill]->cmd);
 }
 
-static int _jtag_setspeed(JDRV *d, int khz) {
-	return d->speed;
+// reply bytes that may still be queued into the current txn's buffer
+static inline u32 rx_avail(JDRV *d) {
+	return CMD_MAX - d->replied;
+}
+
+// room for another caller buffer in the current txn
+static inline int seg_avail(JDRV *d) {
+	JTXN *t = d->txn[d->fill];
+	return (t->txsegs < (SEG_MAX - 2)) && (t->rxsegs < (SEG_MAX - 2));
 }
 
 static void resetstate(JDRV *d) {
+	JTXN *t = d->txn[d->fill];
 	d->status = 0;
-	d->next = d->cmd;
-	d->nextop = d->op;
+	d->next = t->cmd;
+	d->nextop = t->op;
+	d->seg = t->cmd;
 	d->expected = 0;
+	d->replied = 0;
+	t->txsegs = 0;
+	t->rxsegs = 0;
+}
+
+// claim n bytes of the reply stream, to be decoded from reply[] by JOPs
+static void rx_reply(JDRV *d, u32 n) {
+	JTXN *t = d->txn[d->fill];
+	JSEG *s = t->rx + t->rxsegs;
+	u8 *x = t->reply + d->replied;
+	if (t->rxsegs && ((s[-1].ptr + s[-1].len) == x)) {
+		s[-1].len += n;
+	} else {
+		s->ptr = x;
+		s->len = n;
+		t->rxsegs++;
+	}
+	d->replied += n;
+	d->expected += n;
+}
+
+// claim n bytes of the reply stream, to land directly in ptr
+static void rx_direct(JDRV *d, u8 *ptr, u32 n) {
+	JTXN *t = d->txn[d->fill];
+	t->rx[t->rxsegs].ptr = ptr;
+	t->rx[t->rxsegs].len = n;
+	t->rxsegs++;
+	d->expected += n;
+}
+
+// send n bytes from ptr next, without copying them into cmd[]
+static void tx_direct(JDRV *d, u8 *ptr, u32 n) {
+	JTXN *t = d->txn[d->fill];
+	if (d->next != d->seg) {
+		t->tx[t->txsegs].ptr = d->seg;
+		t->tx[t->txsegs].len = d->next - d->seg;
+		t->txsegs++;
+	}
+	t->tx[t->txsegs].ptr = ptr;
+	t->tx[t->txsegs].len = n;
+	t->txsegs++;
+	d->seg = d->next;
+}
+
+// While recording, note that bits tdi bits of the current site are
+// being placed at *at, from bit shift on.
+static void rec_tdi(JDRV *d, u8 *at, u32 bits, u32 shift) {
+	JPATCH *p;
+	if (!d->rec || (d->rec_left == 0))
+		return;
+	if (d->rec_npatches == PATCH_MAX) {
+		fprintf(stderr, "jtag: program has too many scans\n");
+		d->status = -1;
+		return;
+	}
+	if (bits > d->rec_left)
+		bits = d->rec_left;
+	p = d->rec_patch + d->rec_npatches++;
+	p->site = d->rec_nsites - 1;
+	p->bit = d->rec_bit;
+	p->at = at - d->txn[d->fill]->cmd;
+	p->n = bits;
+	p->shift = shift;
+	d->rec_bit += bits;
+	d->rec_left -= bits;
 }
 
 #define FTDI_REQTYPE_OUT	(LIBUSB_REQUEST_TYPE_VENDOR \
@@ -151,6 +356,7 @@ static int ftdi_mpsse_enable(JDRV *d) {
 }
 
 static int ftdi_open(JDRV *d) {
+	struct libusb_device_descriptor desc;
 	struct libusb_device_handle *udev;
 	int n;
 
@@ -169,11 +375,18 @@ static int ftdi_open(JDRV *d) {
 			continue;
 		}
 		d->udev = udev;
-		d->read_ptr = d->read_buffer;
-		d->read_size = 512;
-		d->read_count = 0;
 		d->ep_in = devinfo[n].ep_in;
 		d->ep_out = devinfo[n].ep_out;
+		// full speed parts use 64 byte packets, high speed 512
+		d->pktsize = libusb_get_max_packet_size(libusb_get_device(udev), d->ep_in);
+		if ((d->pktsize < 64) || (d->pktsize > 512)) {
+			d->pktsize = 512;
+		}
+		if (libusb_get_device_descriptor(libusb_get_device(udev), &desc) == 0) {
+			d->type = desc.bcdDevice;
+		} else {
+			d->type = FTDI_TYPE_2232H;
+		}
 		return 0;
 	}
 	fprintf(stderr, "jtag_init: failed to find usb device\n");
@@ -183,260 +396,585 @@ static int ftdi_open(JDRV *d) {
 static int usb_bulk(struct libusb_device_handle *udev,
 	unsigned char ep, void *data, int len, unsigned timeout) {
 	int r, xfer;
-#if TRACE_USB
-	if (!(ep & 0x80))
-		dump("xmit", data, len);
-#endif
 	r = libusb_bulk_transfer(udev, ep, data, len, &xfer, timeout);
 	if (r < 0) {
 		fprintf(stderr,"bulk: error: %d\n", r);
 		return r;
 	}
-#if TRACE_USB
-	if (ep & 0x80)
-		dump("recv", data, xfer);
-#endif
 	return xfer;
 }
 
-/* TODO: handle smaller packet size for lowspeed version of the part */
-/* TODO: multi-packet reads */
-/* TODO: asynch/background reads */
-static int ftdi_read(JDRV *d, unsigned char *buffer, int count, int timeout) {
-	int xfer;
+static u8 MASKBITS[9] = {
+	0x00, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF
+};
+
+// process the reply of a completed txn
+static void txn_reply(JTXN *t) {
+	JOP *op;
+	u8 *x;
+
+	for (op = t->op, x = t->reply;;op++) {
+		switch(op->op) {
+		case OP_END:
+			return;
+		case OP_BITS:
+			*op->ptr = ((*x) >> (8 - op->n)) & MASKBITS[op->n];
+			x++;
+			break;
+		case OP_BYTES:
+			memcpy(op->ptr, x, op->n);
+			x += op->n;
+			break;
+		case OP_1BIT:
+			if (*x & op->n) {
+				*op->ptr |= op->x;
+			} else {
+				*op->ptr &= (~op->x);
+			}
+			x++;
+			break;
+		}
+	}
+}
+
+// retire completed txns, oldest first
+static void txn_retire(JDRV *d) {
+	JTXN *t;
+	for (;;) {
+		t = d->txn[d->done];
+		if (!t->busy || t->sending || (t->received != t->expected))
+			return;
+		if (d->status)
+			return;
+		if (d->trace) {
+			u32 n;
+			for (n = 0; n < t->rxsegs; n++)
+				jtrace_add(d->trace, JTRACE_RX, t->rx[n].ptr, t->rx[n].len);
+		}
+		txn_reply(t);
+		t->busy = 0;
+		d->done = (d->done + 1) % TXN_MAX;
+		d->retired++;
+	}
+}
+
+static void usb_tx_done(struct libusb_transfer *usb) {
+	JTXN *t = usb->user_data;
+	t->sending--;
+	if (usb->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+	if ((usb->status != LIBUSB_TRANSFER_COMPLETED) ||
+		(usb->actual_length != usb->length)) {
+		fprintf(stderr, "jtag_commit: write failed\n");
+		t->d->status = -1;
+	}
+}
+
+// distribute reply data across submitted txns, in submission order
+static void rx_data(JDRV *d, u8 *data, u32 count) {
+	JTXN *t;
+	JSEG *s;
+	u32 n, i = d->done;
 	while (count > 0) {
-		if (d->read_count >= count) {
-			memcpy(buffer, d->read_ptr, count);
-			d->read_count -= count;
-			d->read_ptr += count;
-			return 0;
+		if (d->rx_pending == 0) {
+			fprintf(stderr, "jtag_commit: unexpected reply data\n");
+			d->status = -1;
+			return;
+		}
+		t = d->txn[i];
+		if (t->received == t->expected) {
+			i = (i + 1) % TXN_MAX;
+			continue;
 		}
-		if (d->read_count > 0) {
-			memcpy(buffer, d->read_ptr, d->read_count);
-			count -= d->read_count;
-			buffer += d->read_count;
-			d->read_count = 0;
+		s = t->rx + t->rxseg;
+		n = s->len - t->rxoff;
+		if (n > count)
+			n = count;
+		// direct reads arrive already in place
+		if ((s->ptr + t->rxoff) != data)
+			memcpy(s->ptr + t->rxoff, data, n);
+		t->rxoff += n;
+		if (t->rxoff == s->len) {
+			t->rxseg++;
+			t->rxoff = 0;
 		}
-		xfer = usb_bulk(d->udev, d->ep_in, d->read_buffer, d->read_size, 1000);
-		if (xfer < 0)
-			return -1;
-		if (xfer < 2)
-			return -1;
-		/* discard header */
-		d->read_ptr = d->read_buffer + 2;
-		d->read_count = xfer - 2;
+		t->received += n;
+		d->rx_pending -= n;
+		data += n;
+		count -= n;
 	}
-	return 0;
 }
 
-static int _jtag_close(JDRV *d) {
-	if (d->udev) {
-		//TODO: close
+// Every packet the ftdi sends starts with a 2 byte modem status header.
+// Strip them all in place, returning the payload length.
+static u32 ftdi_strip(u8 *data, u32 len, u32 pktsize) {
+	u8 *out = data;
+	u8 *start = data;
+	u32 n;
+	while (len > 2) {
+		n = (len > pktsize) ? pktsize : len;
+		memmove(out, data + 2, n - 2);
+		out += (n - 2);
+		data += n;
+		len -= n;
 	}
-	free(d);
-	return 0;
+	return out - start;
 }
 
-static int _jtag_init(JDRV *d) {
-	d->speed = 15000;
-	resetstate(d);
-	if (ftdi_open(d))
-		goto fail;
-	if (ftdi_reset(d))
-		goto fail;
-	if (ftdi_mpsse_enable(d))
-		goto fail;
-	if (usb_bulk(d->udev, d->ep_out, mpsse_init, sizeof(mpsse_init), 1000) != sizeof(mpsse_init))
-		goto fail;
+static void usb_rx_done(struct libusb_transfer *usb) {
+	JDRV *d = usb->user_data;
+	u32 n;
+	d->rx_busy = 0;
+	if (usb->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+	if ((usb->status != LIBUSB_TRANSFER_COMPLETED) ||
+		(usb->actual_length < 2)) {
+		fprintf(stderr, "jtag_commit: read failed\n");
+		d->status = -1;
+		return;
+	}
+	TRACE(JTRACE_USBIN, &usb->actual_length, 4);
+	n = ftdi_strip(usb->buffer, usb->actual_length, d->pktsize);
+	if (n == 0) {
+		// status only, the device has nothing for us yet
+		if (d->rx_stall == 0) {
+			d->rx_stall = NOW();
+		} else if ((NOW() - d->rx_stall) > RX_TIMEOUT) {
+			fprintf(stderr, "jtag_commit: read timed out\n");
+			d->status = -1;
+		}
+		return;
+	}
+	d->rx_stall = 0;
+	rx_data(d, usb->buffer, n);
+}
+
+// Keep a read queued while the device owes us data.
+// Ask for just enough whole packets to carry what is owed, so the
+// transfer completes as soon as the last of it arrives.
+// If the next reply bytes belong in a caller's buffer, and at least a
+// packet's worth remain, read straight into it: the raw packets are
+// never larger than the space left and strip down in place.
+static int rx_start(JDRV *d) {
+	JTXN *t;
+	JSEG *s;
+	u8 *buf = d->read_buffer;
+	u32 len, i = d->done;
+	if (d->rx_busy || (d->rx_pending == 0) || d->status)
+		return 0;
+	for (t = d->txn[i]; t->received == t->expected; t = d->txn[i])
+		i = (i + 1) % TXN_MAX;
+	s = t->rx + t->rxseg;
+	len = s->len - t->rxoff;
+	if (((s->ptr < t->reply) || (s->ptr >= (t->reply + CMD_MAX))) &&
+		(len >= d->pktsize)) {
+		buf = s->ptr + t->rxoff;
+		len = (len / d->pktsize) * d->pktsize;
+	} else {
+		len = d->rx_pending + (d->pktsize - 3);
+		len = (len / (d->pktsize - 2)) * d->pktsize;
+		if (len > RX_MAX)
+			len = RX_MAX;
+	}
+	libusb_fill_bulk_transfer(d->rx_usb, d->udev, d->ep_in,
+		buf, len, usb_rx_done, d, 1000);
+	if (libusb_submit_transfer(d->rx_usb) < 0) {
+		fprintf(stderr, "jtag_commit: read failed\n");
+		return (d->status = -1);
+	}
+	d->usb_in++;
+	d->rx_busy = 1;
 	return 0;
-	
-fail:
-	_jtag_close(d);
-	return -1;
 }
 
-#if TRACE_DIS
-static void pbin(u32 val, u32 bits) {
+static int usb_inflight(JDRV *d) {
 	u32 n;
-	for (n = 0; n < bits; n++) {
-		fprintf(stderr, "%c", (val & 1) ? '1' : '0');
-		val >>= 1;
-	}
-}
-
-// display mpsse command stream in a (sortof) human readable form
-static void dismpsse(u8 *data, u32 n) {
-	u32 x, i;
-	while (n > 0) {
-		fprintf(stderr,"%02x: ", data[0]);
-		switch(data[0]) {
-		case 0x6B: // tms rw
-			fprintf(stderr, "x1 <- TDO, ");
-			// fall through
-		case 0x4B: // tms wo
-			fprintf(stderr, "TMS <- ");
-			pbin(data[2],data[1]+1);
-			fprintf(stderr, ", TDI <- ");
-			pbin((data[2] & 0x80) ? 0xFF : 0, data[1] + 1);
-			fprintf(stderr, "\n");
-			data += 3;
-			n -= 3;
-			break;
-		case 0x2A: // ro bits
-			fprintf(stderr, "x%d <- TDO\n", data[1] + 1);
-			data += 2;
-			n -= 2;
-			break;
-		case 0x28: // ro bytes
-			x = ((data[2] << 8) | data[1]) + 1;
-			fprintf(stderr, "x%d <- TDO\n", (int) x * 8);
-			data += 3;
-			n -= 3;
-			break;
-		case 0x1B: // wo bits
-		case 0x3B: // rw bits
-			fprintf(stderr, "TDI <- ");
-			pbin(data[2], data[1] + 1);
-			if (data[0] == 0x3B) {
-				fprintf(stderr, ", x%d <- TDO\n", data[1] + 1);
-			} else {
-				fprintf(stderr, "\n");
-			}
-			data += 3;
-			n -= 3;
-			break;
-		case 0x19: // wo bytes
-		case 0x39: // rw bytes
-			x = ((data[2] << 8) | data[1]) + 1;
-			fprintf(stderr, "TDI <- ");
-			for (i = 0; i < x; i++) pbin(data[3+i], 8);
-			if (data[0] == 0x1B) {
-				fprintf(stderr, ", x%d <- TDO\n", (int) x);
-			} else {
-				fprintf(stderr,"\n");
-			}
-			data += (3 + x);
-			n -= (3 + x);
-			break;
-		case 0x87:
-			fprintf(stderr,"FLUSH\n");
-			data += 1;
-			n -= 1;
+	if (d->rx_busy)
+		return 1;
+	for (n = 0; n < TXN_MAX; n++) {
+		if (d->txn[n]->busy && d->txn[n]->sending)
+			return 1;
+	}
+	return 0;
+}
+
+// handle one round of usb completions
+static int usb_pump(JDRV *d) {
+	u64 t0;
+	int r;
+	if (rx_start(d))
+		return -1;
+	if (!usb_inflight(d)) {
+		fprintf(stderr, "jtag_commit: txn stalled\n");
+		return (d->status = -1);
+	}
+	t0 = NOW();
+	r = libusb_handle_events(NULL);
+	d->wait_ns += NOW() - t0;
+	if (r < 0) {
+		fprintf(stderr, "jtag_commit: usb event error\n");
+		return (d->status = -1);
+	}
+	txn_retire(d);
+	return d->status ? -1 : 0;
+}
+
+// cancel anything in flight and forget all queued txns
+static void usb_abort(JDRV *d) {
+	JTXN *t;
+	u32 n, i;
+	if (d->rx_busy)
+		libusb_cancel_transfer(d->rx_usb);
+	for (n = 0; n < TXN_MAX; n++) {
+		t = d->txn[n];
+		if (!t->busy || !t->sending)
+			continue;
+		for (i = 0; i < t->txsegs; i++)
+			libusb_cancel_transfer(t->usb[i]);
+	}
+	while (usb_inflight(d)) {
+		if (libusb_handle_events(NULL) < 0)
 			break;
-		default:
-			fprintf(stderr,"??? 0x%02x\n", data[0]);
-			n = 0;
+	}
+	for (n = 0; n < TXN_MAX; n++) {
+		d->txn[n]->busy = 0;
+	}
+	if (d->retired != d->queued) {
+		d->lost_lo = d->retired;
+		d->lost_hi = d->queued;
+		d->retired = d->queued;
+	}
+	d->fill = 0;
+	d->done = 0;
+	d->rx_pending = 0;
+	d->rx_stall = 0;
+}
+
+// Submit the txn being assembled, without waiting for its reply,
+// and begin assembling the next one (once its buffer has drained).
+static int txn_queue(JDRV *d) {
+	JTXN *t = d->txn[d->fill];
+	u32 n;
+
+	if (d->status)
+		return -1;
+	if (d->rec) {
+		// programs must fit in one command buffer
+		fprintf(stderr, "jtag: program too large\n");
+		return (d->status = -1);
+	}
+
+	// always complete with an ioflush
+	*d->next++ = 0x87;
+	d->nextop->op = OP_END;
+	t->tx[t->txsegs].ptr = d->seg;
+	t->tx[t->txsegs].len = d->next - d->seg;
+	t->txsegs++;
+	t->expected = d->expected;
+	t->received = 0;
+	t->rxseg = 0;
+	t->rxoff = 0;
+
+	if (d->trace) {
+		u32 info[2] = { 0, t->expected };
+		for (n = 0; n < t->txsegs; n++)
+			info[0] += t->tx[n].len;
+		jtrace_add(d->trace, JTRACE_TXN, info, sizeof(info));
+	}
+	for (n = 0; n < t->txsegs; n++) {
+		TRACE(JTRACE_TX, t->tx[n].ptr, t->tx[n].len);
+		libusb_fill_bulk_transfer(t->usb[n], d->udev, d->ep_out,
+			t->tx[n].ptr, t->tx[n].len, usb_tx_done, t, 1000);
+		if (libusb_submit_transfer(t->usb[n]) < 0) {
+			fprintf(stderr, "jtag_commit: write failed\n");
+			t->busy = (t->sending != 0);
+			return (d->status = -1);
 		}
+		d->usb_out++;
+		d->tx_bytes += t->tx[n].len;
+		t->sending++;
+	}
+	t->busy = 1;
+	d->rx_bytes += t->expected;
+	d->txns++;
+	d->rx_pending += t->expected;
+	d->queued++;
+
+	d->fill = (d->fill + 1) % TXN_MAX;
+	while (d->txn[d->fill]->busy) {
+		if (usb_pump(d))
+			return -1;
 	}
+	d->next = d->txn[d->fill]->cmd;
+	d->nextop = d->txn[d->fill]->op;
+	d->seg = d->next;
+	d->expected = 0;
+	d->replied = 0;
+	d->txn[d->fill]->txsegs = 0;
+	d->txn[d->fill]->rxsegs = 0;
+	return 0;
 }
-#endif
 
-static u8 MASKBITS[9] = {
-	0x00, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF
-};
+static void trace_done(JDRV *d, int status) {
+	TRACE(JTRACE_DONE, &status, sizeof(status));
+}
 
 static int _jtag_commit(JDRV *d) {
-	unsigned n = d->next - d->cmd;
-	JOP *op;
-	u8 *x;
-
-#if TRACE_TXN
-	fprintf(stderr, "jtag_commit: tx(%d) rx(%d)\n", n, (int) d->expected);
-#endif
+	u32 kind = 0;
+	TRACE(JTRACE_COMMIT, &kind, sizeof(kind));
 	if (d->status) {
 		// if we failed during prep, error out immediately
 		fprintf(stderr, "jtag_commit: pre-existing errors\n");
 		goto fail;
 	}
-	if (n == 0) {
-		goto done;
+	if (d->next != d->txn[d->fill]->cmd) {
+		if (txn_queue(d))
+			goto fail;
+		d->explicit++;
 	}
+	while (d->txn[d->done]->busy) {
+		if (usb_pump(d))
+			goto fail;
+	}
+	resetstate(d);
+	trace_done(d, 0);
+	return 0;
+fail:
+	usb_abort(d);
+	resetstate(d);
+	trace_done(d, -1);
+	return -1;
+}
 
-	// always complete with an ioflush
-	*d->next = 0x87;
-	n++;
-	d->nextop->op = OP_END;
-
-#if TRACE_IO
-	dump("tx", d->cmd, n);
-#endif
-#if TRACE_DIS
-	dismpsse(d->cmd, n);
-#endif
-
-	if (usb_bulk(d->udev, d->ep_out, d->cmd, n, 1000) != n) {
-		fprintf(stderr, "jtag_commit: write failed\n");
+// Queue everything so far without waiting for it to complete.
+// The ticket is that of the last txn holding these scans.
+static int _jtag_submit(JDRV *d, u32 *ticket) {
+	u32 kind = 1;
+	TRACE(JTRACE_COMMIT, &kind, sizeof(kind));
+	if (d->status) {
+		fprintf(stderr, "jtag_submit: pre-existing errors\n");
 		goto fail;
 	}
-	if (ftdi_read(d, d->cmd, d->expected, 1000)) {
-		fprintf(stderr, "jtag_commit: read failed\n");	
+	if (d->next != d->txn[d->fill]->cmd) {
+		if (txn_queue(d))
+			goto fail;
+		d->explicit++;
+	}
+	// get the reply flowing
+	if (rx_start(d))
 		goto fail;
+	*ticket = d->queued;
+	trace_done(d, 0);
+	return 0;
+fail:
+	usb_abort(d);
+	resetstate(d);
+	trace_done(d, -1);
+	return -1;
+}
+
+// Returns 1 once the txn with this ticket (and all before it) has
+// completed, 0 if it has not yet and block is 0, negative on error.
+static int _jtag_wait(JDRV *d, u32 ticket, int block) {
+	struct timeval tv;
+	if (d->status)
+		return -1;
+	if (block && ((int) (ticket - d->retired) > 0)) {
+		TRACE(JTRACE_WAIT, &ticket, sizeof(ticket));
+	}
+	while ((int) (ticket - d->retired) > 0) {
+		if (block) {
+			if (usb_pump(d))
+				goto fail;
+			continue;
+		}
+		if (rx_start(d))
+			goto fail;
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		if (libusb_handle_events_timeout(NULL, &tv) < 0) {
+			fprintf(stderr, "jtag_wait: usb event error\n");
+			d->status = -1;
+			goto fail;
+		}
+		txn_retire(d);
+		if (d->status)
+			goto fail;
+		if ((int) (ticket - d->retired) > 0)
+			return 0;
 	}
+	if (((int) (ticket - d->lost_lo) > 0) && ((int) (ticket - d->lost_hi) <= 0))
+		return -1;
+	if (block)
+		trace_done(d, 0);
+	return 1;
+fail:
+	// drop everything in flight, and whatever is being assembled,
+	// so the next submit or commit reports the failure too
+	usb_abort(d);
+	resetstate(d);
+	d->status = -1;
+	trace_done(d, -1);
+	return -1;
+}
 
-#if TRACE_IO
-	dump("rx", d->cmd, d->expected);
-#endif
+// The H parts run the MPSSE from 60MHz, TCK = 30MHz / (1 + divisor),
+// or from 12MHz with divide-by-5 enabled.  The original 2232C/D runs
+// it from 12MHz and has neither divide-by-5 nor adaptive clocking.
+// khz == 0 selects adaptive clocking (TCK paced by RTCK).
+static int _jtag_setspeed(JDRV *d, int khz) {
+	u32 base, div;
+	u8 *x;
 
-	for (op = d->op, x = d->cmd;;op++) {
-		switch(op->op) {
-		case OP_END:
-			goto done;
-		case OP_BITS:
-			*op->ptr = ((*x) >> (8 - op->n)) & MASKBITS[op->n];
-			x++;
-			break;
-		case OP_BYTES:
-			memcpy(op->ptr, x, op->n);
-			x += op->n;
-			break;
-		case OP_1BIT:
-			if (*x & op->n) {
-				*op->ptr |= op->x;
-			} else {
-				*op->ptr &= (~op->x);
+	if (khz < 0)
+		return d->speed;
+	if (cmd_avail(d) < 8) {
+		if (txn_queue(d))
+			return -1;
+	}
+	x = d->next;
+	if (d->type < FTDI_TYPE_2232H) {
+		if (khz == 0) {
+			fprintf(stderr, "jtag_setspeed: adaptive clocking unsupported\n");
+			return -1;
+		}
+		base = 6000;
+	} else {
+		if (khz == 0) {
+			if (d->type == FTDI_TYPE_4232H) {
+				fprintf(stderr, "jtag_setspeed: adaptive clocking unsupported\n");
+				return -1;
 			}
-			x++;
-			break;
+			*x++ = 0x96; // enable adaptive clocking
+		} else if (d->type != FTDI_TYPE_4232H) {
+			*x++ = 0x97; // disable adaptive clocking
+		}
+		base = 30000;
+		if (khz && ((base / khz) > 0x10000)) {
+			*x++ = 0x8b; // enable clock/5
+			base = 6000;
+		} else {
+			*x++ = 0x8a; // disable clock/5
 		}
 	}
-done:
+	// round the divisor up so we never exceed the requested rate
+	if ((khz == 0) || (khz >= base)) {
+		div = 0;
+	} else {
+		div = (base + khz - 1) / khz - 1;
+		if (div > 0xFFFF)
+			div = 0xFFFF;
+	}
+	*x++ = 0x86; // set divisor
+	*x++ = div;
+	*x++ = div >> 8;
+	d->next = x;
+	if (_jtag_commit(d))
+		return -1;
+	d->speed = khz ? (base / (div + 1)) : 0;
+	return d->speed;
+}
+
+static int _jtag_close(JDRV *d) {
+	u32 n, i;
+	if (d->udev) {
+		usb_abort(d);
+		//TODO: close
+	}
+	for (n = 0; n < TXN_MAX; n++) {
+		if (d->txn[n]) {
+			for (i = 0; i < SEG_MAX; i++)
+				libusb_free_transfer(d->txn[n]->usb[i]);
+			free(d->txn[n]);
+		}
+	}
+	libusb_free_transfer(d->rx_usb);
+	jtrace_close(d->trace);
+	free(d);
+	return 0;
+}
+
+static int _jtag_init(JDRV *d) {
+	const char *fn;
+	u32 n, i;
+	if ((fn = getenv("JTAG_TRACE")) != NULL) {
+		fn = getenv("JTAG_TRACE_KB");
+		d->trace = jtrace_open(getenv("JTAG_TRACE"),
+			fn ? strtoul(fn, 0, 0) : 0);
+	}
+	for (n = 0; n < TXN_MAX; n++) {
+		if ((d->txn[n] = malloc(sizeof(JTXN))) == 0)
+			goto fail;
+		memset(d->txn[n], 0, sizeof(JTXN));
+		d->txn[n]->d = d;
+		for (i = 0; i < SEG_MAX; i++) {
+			if ((d->txn[n]->usb[i] = libusb_alloc_transfer(0)) == 0)
+				goto fail;
+		}
+	}
+	if ((d->rx_usb = libusb_alloc_transfer(0)) == 0)
+		goto fail;
 	resetstate(d);
+	if (ftdi_open(d))
+		goto fail;
+	if (ftdi_reset(d))
+		goto fail;
+	if (ftdi_mpsse_enable(d))
+		goto fail;
+	TRACE(JTRACE_TX, mpsse_init, sizeof(mpsse_init));
+	if (usb_bulk(d->udev, d->ep_out, mpsse_init, sizeof(mpsse_init), 1000) != sizeof(mpsse_init))
+		goto fail;
+	if (_jtag_setspeed(d, DEFAULT_KHZ) < 0)
+		goto fail;
 	return 0;
+	
 fail:
-	resetstate(d);
+	_jtag_close(d);
 	return -1;
 }
 
+// mpsse tms commands clock at most 7 bits, longer paths are split
+// tdi is held at obit throughout, tdo is captured on the first clock
 static int _jtag_scan_tms(JDRV *d, u32 obit,
 	u32 count, u8 *tbits, u32 ioffset, u8 *ibits) {
-	if ((count > 6) || (count == 0)) {
+	u32 n, tms, shift = 0;
+	if ((count > 16) || (count == 0)) {
 		fprintf(stderr, "jtag_scan_tms: invalid count %d\n", (int) count);
 		return (d->status = -1);
 	}
-	if (cmd_avail(d) < 4) {
-		if (_jtag_commit(d))
-			return (d->status = -1);
-	}
-	*d->next++ = ibits ? 0x6B : 0x4B;
-	*d->next++ = count - 1;
-	*d->next++ = ((obit & 1) << 7) | (*tbits);
-	if (ibits) {
-		if (ioffset > 7) {
-			ibits += (ioffset >> 3);
-			ioffset &= 7;
+	tms = tbits[0] | ((count > 8) ? (tbits[1] << 8) : 0);
+	while (count > 0) {
+		n = (count > 7) ? 7 : count;
+		if ((cmd_avail(d) < 4) || (ibits && (rx_avail(d) < 1))) {
+			if (txn_queue(d))
+				return (d->status = -1);
 		}
-		d->nextop->op = OP_1BIT;
-		d->nextop->ptr = ibits;
-		d->nextop->n = 1 << (8 - count);
-		d->nextop->x = 1 << ioffset;
-		d->nextop++;
-		d->expected++;
+		*d->next++ = ibits ? 0x6B : 0x4B;
+		*d->next++ = n - 1;
+		if (shift == 0)
+			rec_tdi(d, d->next, 1, 7);
+		*d->next++ = ((obit & 1) << 7) | ((tms >> shift) & 0x7F);
+		if (ibits) {
+			if (ioffset > 7) {
+				ibits += (ioffset >> 3);
+				ioffset &= 7;
+			}
+			d->nextop->op = OP_1BIT;
+			d->nextop->ptr = ibits;
+			d->nextop->n = 1 << (8 - n);
+			d->nextop->x = 1 << ioffset;
+			d->nextop++;
+			rx_reply(d, 1);
+			ibits = 0;
+		}
+		shift += n;
+		count -= n;
 	}
 	return -1;
 }
 
 static int _jtag_scan_io(JDRV *d, u32 count, u8 *obits, u8 *ibits) {
-	u32 n;
+	u32 n, big;
 	u32 bcount = count >> 3;
 	u8 bytecmd;
 	u8 bitcmd;
@@ -468,30 +1006,50 @@ static int _jtag_scan_io(JDRV *d, u32 count, u8 *obits, u8 *ibits) {
 	// TODO: for exactly 1 byte, bitmove command is more efficient
 	while (bcount > 0) {
 		n = cmd_avail(d);
+		big = (bcount >= ZC_MIN) && !d->rec;
 
-		if (n < 16) {
-			if (_jtag_commit(d))
+		if ((n < 16) || (!big && ibits && (rx_avail(d) < 16)) ||
+			(big && !seg_avail(d))) {
+			if (txn_queue(d))
 				return (d->status = -1);
 			continue;
 		}
-		n -= 4; // leave room for header and io commit
-		if (n > bcount)
-			n = bcount;
+		if (big) {
+			// large moves go straight to/from the caller's buffers
+			n = obits ? ZC_MAX : RX_MAX;
+			if (n > bcount)
+				n = bcount;
+		} else {
+			n -= 4; // leave room for header and io commit
+			if (ibits && (n > rx_avail(d)))
+				n = rx_avail(d);
+			if (n > bcount)
+				n = bcount;
+		}
 		*d->next++ = bytecmd;
 		*d->next++ = (n - 1);
 		*d->next++ = (n - 1) >> 8;
 		if (obits) {
-			memcpy(d->next, obits, n);
-			d->next += n;
+			if (big) {
+				tx_direct(d, obits, n);
+			} else {
+				rec_tdi(d, d->next, n * 8, 0);
+				memcpy(d->next, obits, n);
+				d->next += n;
+			}
 			obits += n;
 		}
 		if (ibits) {
-			d->nextop->op = OP_BYTES;
-			d->nextop->ptr = ibits;
-			d->nextop->n = n;
-			d->nextop++;
+			if (big) {
+				rx_direct(d, ibits, n);
+			} else {
+				d->nextop->op = OP_BYTES;
+				d->nextop->ptr = ibits;
+				d->nextop->n = n;
+				d->nextop++;
+				rx_reply(d, n);
+			}
 			ibits += n;
-			d->expected += n;
 		}
 		bcount -= n;
 	}
@@ -500,13 +1058,14 @@ static int _jtag_scan_io(JDRV *d, u32 count, u8 *obits, u8 *ibits) {
 	count = count & 7;
 	if (count == 0)
        		return 0;
-	if (cmd_avail(d) < 4) {
-		if (_jtag_commit(d))
+	if ((cmd_avail(d) < 4) || (ibits && (rx_avail(d) < 1))) {
+		if (txn_queue(d))
 			return (d->status = -1);
 	}
 	*d->next++ = bitcmd;
 	*d->next++ = count - 1;
 	if (obits) {
+		rec_tdi(d, d->next, count, 0);
 		*d->next++ = *obits;
 	}
 	if (ibits) {
@@ -514,11 +1073,197 @@ static int _jtag_scan_io(JDRV *d, u32 count, u8 *obits, u8 *ibits) {
 		d->nextop->ptr = ibits;
 		d->nextop->n = count;
 		d->nextop++;
-		d->expected++;
+		rx_reply(d, 1);
+	}
+	return 0;
+}
+
+static int _jtag_prog_begin(JDRV *d) {
+	if (d->rec) {
+		fprintf(stderr, "jtag: already recording\n");
+		return -1;
+	}
+	// give the program a whole command buffer to itself
+	if (d->next != d->txn[d->fill]->cmd) {
+		if (txn_queue(d))
+			return -1;
 	}
+	d->rec = 1;
+	d->rec_left = 0;
+	d->rec_nsites = 0;
+	d->rec_npatches = 0;
 	return 0;
 }
 
+static void _jtag_prog_mark(JDRV *d, u32 count, u8 *wbits, u8 *rbits) {
+	JTXN *t = d->txn[d->fill];
+	if (!d->rec)
+		return;
+	if (d->rec_nsites == SITE_MAX) {
+		fprintf(stderr, "jtag: program has too many scans\n");
+		d->status = -1;
+		return;
+	}
+	if (d->rec_nsites)
+		d->rec_site[d->rec_nsites - 1].op1 = d->nextop - t->op;
+	d->rec_site[d->rec_nsites].rbits = rbits;
+	d->rec_site[d->rec_nsites].op0 = d->nextop - t->op;
+	d->rec_nsites++;
+	d->rec_left = wbits ? count : 0;
+	d->rec_bit = 0;
+}
+
+static JCODE *_jtag_prog_end(JDRV *d) {
+	JTXN *t = d->txn[d->fill];
+	JCODE *code = 0;
+	u32 len, nops;
+	u8 *x;
+
+	if (!d->rec)
+		return 0;
+	d->rec = 0;
+	if (d->status)
+		goto done;
+	if (d->rec_nsites)
+		d->rec_site[d->rec_nsites - 1].op1 = d->nextop - t->op;
+	len = d->next - t->cmd;
+	nops = d->nextop - t->op;
+	// one allocation: header, ops, sites, patches, commands
+	x = malloc(sizeof(JCODE) + nops * sizeof(JOP) +
+		d->rec_nsites * sizeof(JSITE) +
+		d->rec_npatches * sizeof(JPATCH) + len);
+	if (x == 0)
+		goto done;
+	code = (void*) x;
+	code->len = len;
+	code->nops = nops;
+	code->replied = d->replied;
+	code->nsites = d->rec_nsites;
+	code->npatches = d->rec_npatches;
+	code->op = (void*) (x += sizeof(JCODE));
+	code->site = (void*) (x += nops * sizeof(JOP));
+	code->patch = (void*) (x += d->rec_nsites * sizeof(JSITE));
+	code->cmd = (x += d->rec_npatches * sizeof(JPATCH));
+	memcpy(code->op, t->op, nops * sizeof(JOP));
+	memcpy(code->site, d->rec_site, d->rec_nsites * sizeof(JSITE));
+	memcpy(code->patch, d->rec_patch, d->rec_npatches * sizeof(JPATCH));
+	memcpy(code->cmd, t->cmd, len);
+done:
+	// nothing recorded is ever sent from here
+	resetstate(d);
+	return code;
+}
+
+// queue a recorded program: a memcpy of its commands and ops
+static int _jtag_prog_run(JDRV *d, JCODE *code) {
+	if (d->rec) {
+		fprintf(stderr, "jtag: cannot run a program while recording\n");
+		return (d->status = -1);
+	}
+	if ((cmd_avail(d) < (code->len + 4)) || (rx_avail(d) < code->replied)) {
+		if (txn_queue(d))
+			return (d->status = -1);
+	}
+	memcpy(d->next, code->cmd, code->len);
+	memcpy(d->nextop, code->op, code->nops * sizeof(JOP));
+	d->next += code->len;
+	d->nextop += code->nops;
+	if (code->replied)
+		rx_reply(d, code->replied);
+	return 0;
+}
+
+// replace the tdi data of the nth recorded scan
+static int _jtag_prog_patch(JDRV *d, JCODE *code, u32 site, const u8 *wbits) {
+	JPATCH *p;
+	u32 n, i, b, pos;
+	u8 *x;
+	if (site >= code->nsites) {
+		fprintf(stderr, "jtag: program has no scan %u\n", (unsigned) site);
+		return -1;
+	}
+	for (n = 0, p = code->patch; n < code->npatches; n++, p++) {
+		if (p->site != site)
+			continue;
+		x = code->cmd + p->at;
+		i = 0;
+		if (((p->bit & 7) == 0) && (p->shift == 0)) {
+			i = p->n & (~7);
+			memcpy(x, wbits + (p->bit >> 3), i >> 3);
+		}
+		for (; i < p->n; i++) {
+			b = (wbits[(p->bit + i) >> 3] >> ((p->bit + i) & 7)) & 1;
+			pos = p->shift + i;
+			x[pos >> 3] = (x[pos >> 3] & ~(1 << (pos & 7))) | (b << (pos & 7));
+		}
+	}
+	return 0;
+}
+
+// redirect the tdo data of the nth recorded scan
+static int _jtag_prog_bind(JDRV *d, JCODE *code, u32 site, u8 *rbits) {
+	JSITE *s;
+	u32 n;
+	if (site >= code->nsites) {
+		fprintf(stderr, "jtag: program has no scan %u\n", (unsigned) site);
+		return -1;
+	}
+	s = code->site + site;
+	for (n = s->op0; n < s->op1; n++) {
+		if (code->op[n].ptr)
+			code->op[n].ptr = rbits + (code->op[n].ptr - s->rbits);
+	}
+	s->rbits = rbits;
+	return 0;
+}
+
+static void _jtag_prog_free(JDRV *d, JCODE *code) {
+	free(code);
+}
+
+// Clock count cycles with TMS and TDI held where they are.
+// The H parts have clock-only commands for this, in bytes (8 clocks)
+// or bits, so even very long waits cost a few bytes.  The 2232C/D
+// does not, so there it is tms commands clocking out 7 zeros at a time.
+static int _jtag_clock(JDRV *d, u32 count) {
+	u32 n;
+	while (count > 0) {
+		if (cmd_avail(d) < 8) {
+			if (txn_queue(d))
+				return (d->status = -1);
+		}
+		if (d->type == FTDI_TYPE_2232C) {
+			n = (count > 7) ? 7 : count;
+			*d->next++ = 0x4B;
+			*d->next++ = n - 1;
+			*d->next++ = 0;
+		} else if (count >= 8) {
+			n = count >> 3;
+			if (n > 0x10000)
+				n = 0x10000;
+			*d->next++ = 0x8F;
+			*d->next++ = (n - 1);
+			*d->next++ = (n - 1) >> 8;
+			n <<= 3;
+		} else {
+			n = count;
+			*d->next++ = 0x8E;
+			*d->next++ = n - 1;
+		}
+		count -= n;
+	}
+	return 0;
+}
+
+static void _jtag_stats(JDRV *d, JTAG_STATS *stats) {
+	stats->tx_bytes = d->tx_bytes;
+	stats->rx_bytes = d->rx_bytes;
+	stats->usb_out = d->usb_out;
+	stats->usb_in = d->usb_in;
+	stats->implicit = d->txns - d->explicit;
+	stats->wait_ns = d->wait_ns;
+}
+
 static JDVT vtable = {
 	.init = _jtag_init,
 	.close = _jtag_close,
@@ -526,21 +1271,46 @@ static JDVT vtable = {
 	.commit = _jtag_commit,
 	.scan_tms = _jtag_scan_tms,
 	.scan_io = _jtag_scan_io,
+	.clock = _jtag_clock,
+	.submit = _jtag_submit,
+	.wait = _jtag_wait,
+	.prog_begin = _jtag_prog_begin,
+	.prog_mark = _jtag_prog_mark,
+	.prog_end = _jtag_prog_end,
+	.prog_run = _jtag_prog_run,
+	.prog_patch = _jtag_prog_patch,
+	.prog_bind = _jtag_prog_bind,
+	.prog_free = _jtag_prog_free,
+	.stats = _jtag_stats,
 };
 
-int jtag_mpsse_open(JTAG **jtag) {
+int jtag_mpsse_create(JDRV **drv, JDVT **vt) {
 	JDRV *d;
 
-       	if ((d = malloc(sizeof(JDRV))) == 0) {
+	if ((d = malloc(sizeof(JDRV))) == 0) {
 		return -1;
 	}
 	memset(d, 0, sizeof(JDRV));
 
-	if (jtag_init(jtag, d, &vtable)) {
-		_jtag_close(d);
+	// releases d on failure
+	if (_jtag_init(d)) {
 		return -1;
 	}
-
-	return _jtag_init(d);
+	*drv = d;
+	*vt = &vtable;
+	return 0;
 }
 
+int jtag_mpsse_open(JTAG **jtag) {
+	JDRV *d;
+	JDVT *vt;
+
+	if (jtag_mpsse_create(&d, &vt)) {
+		return -1;
+	}
+	if (jtag_init(jtag, d, vt)) {
+		vt->close(d);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,572 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "jtag-driver.h"
+
+// Capture and replay of driver traffic.
+//
+// The capture driver sits in front of the mpsse driver and logs every
+// call made to it, along with the TDO data each transaction returned.
+// The replay driver reads such a log back, checks that the calls made
+// to it are the same ones, and answers each transaction with the TDO
+// data that was captured, so tools can run without a probe attached.
+//
+// Replay runs flat out unless a link is modeled: JTAG_REPLAY_LATENCY_US
+// is the round trip cost of a transaction and JTAG_REPLAY_KBPS the bulk
+// bandwidth (kB/s).  While modeling, TCK also runs at the speed the log
+// set, and at most REPLAY_DEPTH transactions are in flight at once.
+
+#define JRPL_MAGIC	0x4C50524A // "JRPL"
+#define JRPL_VERSION	1
+
+// The log is a u32 magic, a u32 version, then records:
+// a header, then len bytes of data.
+typedef struct {
+	u32 op;
+	u32 count;
+	u32 arg;
+	u32 len;
+} JRREC;
+
+#define R_TMS	1 // count clocks, arg obit | R_READ, data u16 tbits
+#define R_IO	2 // count bits, arg R_WRITE | R_READ, data TDI bits if written
+#define R_CLOCK	3 // count clocks
+#define R_SPEED	4 // arg khz asked for, count the result
+#define R_END	5 // end of a transaction, arg 0 commit or 1 submit,
+		  // count its status, data the TDO of each read in order
+		  // ((count + 7) / 8 bytes for R_IO, one byte for R_TMS)
+
+#define R_WRITE	0x100
+#define R_READ	0x200
+
+static const char *RNAME[] = {
+	"???", "scan_tms", "scan_io", "clock", "setspeed", "commit",
+};
+
+// like the mpsse driver's TXN_MAX
+#define REPLAY_DEPTH 4
+
+typedef struct {
+	u8 *ptr;
+	u32 count;
+	u32 ioffset; // for the single TDO bit of a scan_tms
+	u32 tms;
+} JREAD;
+
+struct JDRV {
+	// capture: the driver being captured, and the log
+	JDRV *inner;
+	JDVT *ivt;
+	FILE *fp;
+
+	// replay: the log, and how far into it we are
+	u8 *log;
+	u32 size;
+	u32 pos;
+	u32 nrec;
+
+	// reads in the transaction being assembled
+	JREAD *rd;
+	u32 nrd;
+	u32 maxrd;
+
+	int status;
+	u32 tickets;
+
+	// replay link model (latency in ns, 0 kbps is unlimited)
+	u32 model;
+	u64 latency;
+	u32 kbps;
+	int khz;
+	u64 bytes;
+	u64 tcks;
+	u64 due[REPLAY_DEPTH];
+	u32 retired;
+
+	// for jtag_get_stats(), as the modelled link would see it
+	u64 tx_bytes;
+	u64 rx_bytes;
+	u64 txns;
+	u64 wait_ns;
+};
+
+static u64 NOW(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) return 0;
+	return (((u64) ts.tv_sec) * ((u64)1000000000)) + ((u64) ts.tv_nsec);
+}
+
+static void sleep_until(u64 t) {
+	struct timespec ts;
+	u64 now = NOW();
+	if (t > now) {
+		ts.tv_sec = (t - now) / 1000000000ULL;
+		ts.tv_nsec = (t - now) % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int add_read(JDRV *d, u8 *ptr, u32 count, u32 ioffset, u32 tms) {
+	JREAD *rd;
+	if (count == 0)
+		return 0;
+	if (d->nrd == d->maxrd) {
+		u32 max = d->maxrd ? d->maxrd * 2 : 64;
+		if ((rd = realloc(d->rd, max * sizeof(JREAD))) == NULL) {
+			fprintf(stderr, "jtag: out of memory\n");
+			return (d->status = -1);
+		}
+		d->rd = rd;
+		d->maxrd = max;
+	}
+	rd = d->rd + d->nrd++;
+	rd->ptr = ptr;
+	rd->count = count;
+	rd->ioffset = ioffset;
+	rd->tms = tms;
+	return 0;
+}
+
+static u32 read_len(JREAD *rd) {
+	return rd->tms ? 1 : ((rd->count + 7) / 8);
+}
+
+static u32 tms_bits(u32 count, u8 *tbits) {
+	u32 t = tbits[0];
+	if (count > 8)
+		t |= tbits[1] << 8;
+	return t & ((1 << count) - 1);
+}
+
+// ---- capture ----
+
+// data may be NULL for the caller to append len bytes itself
+static void cap_rec(JDRV *d, u32 op, u32 count, u32 arg, const void *data, u32 len) {
+	JRREC r;
+	r.op = op;
+	r.count = count;
+	r.arg = arg;
+	r.len = len;
+	if ((fwrite(&r, sizeof(r), 1, d->fp) != 1) ||
+		(data && len && (fwrite(data, len, 1, d->fp) != 1))) {
+		if (d->status == 0)
+			fprintf(stderr, "jtag-capture: write failed\n");
+		d->status = -1;
+	}
+}
+
+static int cap_setspeed(JDRV *d, int khz) {
+	int r = d->ivt->setspeed(d->inner, khz);
+	cap_rec(d, R_SPEED, r, khz, NULL, 0);
+	return r;
+}
+
+static int cap_scan_tms(JDRV *d, u32 obit, u32 count, u8 *tbits, u32 ioffset, u8 *ibits) {
+	u16 t = tms_bits(count, tbits);
+	cap_rec(d, R_TMS, count, (obit ? 1 : 0) | (ibits ? R_READ : 0), &t, sizeof(t));
+	if (ibits && add_read(d, ibits, 1, ioffset, 1))
+		return -1;
+	return d->ivt->scan_tms(d->inner, obit, count, tbits, ioffset, ibits);
+}
+
+static int cap_scan_io(JDRV *d, u32 count, u8 *obits, u8 *ibits) {
+	cap_rec(d, R_IO, count, (obits ? R_WRITE : 0) | (ibits ? R_READ : 0),
+		obits, obits ? ((count + 7) / 8) : 0);
+	if (ibits && add_read(d, ibits, count, 0, 0))
+		return -1;
+	return d->ivt->scan_io(d->inner, count, obits, ibits);
+}
+
+static int cap_clock(JDRV *d, u32 count) {
+	u8 zero[2] = { 0, 0 };
+	if (d->ivt->clock) {
+		cap_rec(d, R_CLOCK, count, 0, NULL, 0);
+		return d->ivt->clock(d->inner, count);
+	}
+	while (count > 0) {
+		u32 n = (count > 16) ? 16 : count;
+		if (cap_scan_tms(d, 0, n, zero, 0, NULL))
+			return -1;
+		count -= n;
+	}
+	return 0;
+}
+
+// the transaction has completed: log the TDO data it returned
+static int cap_end(JDRV *d, u32 kind, int r) {
+	u32 n, len = 0;
+	u8 bit;
+	JREAD *rd;
+	for (n = 0; n < d->nrd; n++)
+		len += read_len(d->rd + n);
+	cap_rec(d, R_END, r, kind, NULL, len);
+	for (n = 0; n < d->nrd; n++) {
+		rd = d->rd + n;
+		if (rd->tms) {
+			bit = (rd->ptr[rd->ioffset >> 3] >> (rd->ioffset & 7)) & 1;
+			if (fwrite(&bit, 1, 1, d->fp) != 1)
+				d->status = -1;
+		} else if (fwrite(rd->ptr, read_len(rd), 1, d->fp) != 1) {
+			d->status = -1;
+		}
+	}
+	d->nrd = 0;
+	return (r || d->status) ? -1 : 0;
+}
+
+static int cap_commit(JDRV *d) {
+	return cap_end(d, 0, d->ivt->commit(d->inner));
+}
+
+// Transactions are captured one at a time, so the TDO data can be
+// logged right after the calls that asked for it.
+static int cap_submit(JDRV *d, u32 *ticket) {
+	*ticket = ++d->tickets;
+	return cap_end(d, 1, d->ivt->commit(d->inner));
+}
+
+static int cap_wait(JDRV *d, u32 ticket, int block) {
+	return d->status ? -1 : 1;
+}
+
+static void cap_stats(JDRV *d, JTAG_STATS *stats) {
+	if (d->ivt->stats)
+		d->ivt->stats(d->inner, stats);
+}
+
+static int cap_close(JDRV *d) {
+	d->ivt->close(d->inner);
+	if (fclose(d->fp))
+		fprintf(stderr, "jtag-capture: write failed\n");
+	free(d->rd);
+	free(d);
+	return 0;
+}
+
+static JDVT capture_vtable = {
+	.close = cap_close,
+	.setspeed = cap_setspeed,
+	.commit = cap_commit,
+	.scan_tms = cap_scan_tms,
+	.scan_io = cap_scan_io,
+	.clock = cap_clock,
+	.submit = cap_submit,
+	.wait = cap_wait,
+	.stats = cap_stats,
+	// programs are recorded by jtag-core, and captured as plain scans
+};
+
+int jtag_capture_open(JTAG **jtag, const char *fn) {
+	u32 hdr[2] = { JRPL_MAGIC, JRPL_VERSION };
+	JDRV *d;
+
+	if ((d = malloc(sizeof(JDRV))) == 0) {
+		return -1;
+	}
+	memset(d, 0, sizeof(JDRV));
+	if ((d->fp = fopen(fn, "wb")) == NULL) {
+		fprintf(stderr, "jtag-capture: cannot open '%s'\n", fn);
+		free(d);
+		return -1;
+	}
+	if (fwrite(hdr, sizeof(hdr), 1, d->fp) != 1) {
+		fprintf(stderr, "jtag-capture: write failed\n");
+		goto fail;
+	}
+	if (jtag_mpsse_create(&d->inner, &d->ivt)) {
+		goto fail;
+	}
+	if (jtag_init(jtag, d, &capture_vtable)) {
+		cap_close(d);
+		return -1;
+	}
+	return 0;
+fail:
+	fclose(d->fp);
+	free(d);
+	return -1;
+}
+
+// ---- replay ----
+
+static int rp_diverged(JDRV *d, const char *what, u32 op) {
+	if (d->status == 0) {
+		fprintf(stderr, "jtag-replay: record %u: %s %s\n",
+			d->nrec, RNAME[op], what);
+	}
+	return (d->status = -1);
+}
+
+// take the next record, which must be an op
+static int rp_next(JDRV *d, u32 op, JRREC *r, u8 **data) {
+	if (d->status)
+		return -1;
+	if ((d->size - d->pos) < sizeof(JRREC))
+		return rp_diverged(d, "past the end of the log", op);
+	memcpy(r, d->log + d->pos, sizeof(JRREC));
+	if (r->len > (d->size - d->pos - sizeof(JRREC)))
+		return rp_diverged(d, "truncated in the log", op);
+	if (r->op != op) {
+		if ((r->op >= R_TMS) && (r->op <= R_END)) {
+			fprintf(stderr, "jtag-replay: record %u: %s where the log has %s\n",
+				d->nrec, RNAME[op], RNAME[r->op]);
+			return (d->status = -1);
+		}
+		return rp_diverged(d, "where the log is corrupt", op);
+	}
+	*data = d->log + d->pos + sizeof(JRREC);
+	d->pos += sizeof(JRREC) + r->len;
+	d->nrec++;
+	return 0;
+}
+
+static int rp_setspeed(JDRV *d, int khz) {
+	JRREC r;
+	u8 *data;
+	if (rp_next(d, R_SPEED, &r, &data))
+		return -1;
+	if ((int) r.arg != khz)
+		return rp_diverged(d, "asks for another speed", R_SPEED);
+	if ((int) r.count > 0)
+		d->khz = r.count;
+	return r.count;
+}
+
+static int rp_scan_tms(JDRV *d, u32 obit, u32 count, u8 *tbits, u32 ioffset, u8 *ibits) {
+	JRREC r;
+	u8 *data;
+	u16 t;
+	if (rp_next(d, R_TMS, &r, &data))
+		return -1;
+	memcpy(&t, data, sizeof(t));
+	if ((r.count != count) || (t != tms_bits(count, tbits)) ||
+		(r.arg != ((obit ? 1 : 0) | (ibits ? R_READ : 0))))
+		return rp_diverged(d, "takes another path", R_TMS);
+	if (ibits && add_read(d, ibits, 1, ioffset, 1))
+		return -1;
+	d->bytes += 3 * ((count + 6) / 7);
+	d->tcks += count;
+	return 0;
+}
+
+static int rp_scan_io(JDRV *d, u32 count, u8 *obits, u8 *ibits) {
+	JRREC r;
+	u8 *data;
+	u32 n = count / 8;
+	if (rp_next(d, R_IO, &r, &data))
+		return -1;
+	if ((r.count != count) ||
+		(r.arg != ((obits ? R_WRITE : 0) | (ibits ? R_READ : 0))))
+		return rp_diverged(d, "scans another shape", R_IO);
+	if (obits) {
+		if (memcmp(data, obits, n) || ((count & 7) &&
+			((data[n] ^ obits[n]) & ((1 << (count & 7)) - 1))))
+			return rp_diverged(d, "writes other data", R_IO);
+	}
+	if (ibits && add_read(d, ibits, count, 0, 0))
+		return -1;
+	d->bytes += 6 + ((count + 7) / 8) * (obits ? 2 : 1);
+	d->tcks += count;
+	return 0;
+}
+
+static int rp_clock(JDRV *d, u32 count) {
+	JRREC r;
+	u8 *data;
+	if (rp_next(d, R_CLOCK, &r, &data))
+		return -1;
+	if (r.count != count)
+		return rp_diverged(d, "idles for another count", R_CLOCK);
+	d->bytes += 3;
+	d->tcks += count;
+	return 0;
+}
+
+static int rp_wait(JDRV *d, u32 ticket, int block) {
+	if (d->status)
+		return -1;
+	if ((int) (ticket - d->retired) > 0) {
+		if (d->model) {
+			u64 due = d->due[ticket % REPLAY_DEPTH];
+			u64 t0 = NOW();
+			if ((t0 < due) && !block)
+				return 0;
+			sleep_until(due);
+			d->wait_ns += NOW() - t0;
+		}
+		d->retired = ticket;
+	}
+	return 1;
+}
+
+static int rp_submit(JDRV *d, u32 *ticket) {
+	JRREC r;
+	u8 *data;
+	JREAD *rd;
+	u32 n, len;
+	u64 cost, start;
+
+	if (rp_next(d, R_END, &r, &data))
+		goto fail;
+	for (n = 0, len = 0; n < d->nrd; n++)
+		len += read_len(d->rd + n);
+	if (r.len != len) {
+		rp_diverged(d, "reads another amount", R_END);
+		goto fail;
+	}
+	// the data can land now, nobody may look until it is waited on
+	for (n = 0; n < d->nrd; n++) {
+		rd = d->rd + n;
+		if (rd->tms) {
+			rd->ptr[rd->ioffset >> 3] &= ~(1 << (rd->ioffset & 7));
+			rd->ptr[rd->ioffset >> 3] |= (*data & 1) << (rd->ioffset & 7);
+		} else {
+			memcpy(rd->ptr, data, rd->count / 8);
+			if (rd->count & 7) {
+				u8 mask = (1 << (rd->count & 7)) - 1;
+				rd->ptr[rd->count / 8] &= ~mask;
+				rd->ptr[rd->count / 8] |= data[rd->count / 8] & mask;
+			}
+		}
+		data += read_len(rd);
+	}
+	d->nrd = 0;
+
+	*ticket = ++d->tickets;
+	if (d->model) {
+		// only REPLAY_DEPTH in flight, as with real buffers
+		if ((d->tickets - d->retired) > REPLAY_DEPTH)
+			rp_wait(d, d->tickets - REPLAY_DEPTH, 1);
+		// the link and TCK overlap, whichever is slower sets the pace
+		cost = d->kbps ? ((d->bytes * 1000000ULL) / d->kbps) : 0;
+		if (d->khz && (((d->tcks * 1000000ULL) / d->khz) > cost))
+			cost = (d->tcks * 1000000ULL) / d->khz;
+		start = d->due[(d->tickets - 1) % REPLAY_DEPTH];
+		if (start < NOW())
+			start = NOW();
+		d->due[d->tickets % REPLAY_DEPTH] = start + d->latency + cost;
+	}
+	// the link cost counts both ways
+	d->tx_bytes += (d->bytes > len) ? (d->bytes - len) : 0;
+	d->rx_bytes += len;
+	d->txns++;
+	d->bytes = 0;
+	d->tcks = 0;
+	// failures captured are failures replayed
+	return r.count ? -1 : 0;
+fail:
+	d->nrd = 0;
+	return -1;
+}
+
+static int rp_commit(JDRV *d) {
+	u32 ticket;
+	if (rp_submit(d, &ticket))
+		return -1;
+	return (rp_wait(d, ticket, 1) < 0) ? -1 : 0;
+}
+
+static int rp_close(JDRV *d) {
+	if ((d->status == 0) && (d->pos != d->size))
+		fprintf(stderr, "jtag-replay: stopped %u bytes short of the end of the log\n",
+			d->size - d->pos);
+	free(d->log);
+	free(d->rd);
+	free(d);
+	return 0;
+}
+
+static void rp_stats(JDRV *d, JTAG_STATS *stats) {
+	stats->tx_bytes = d->tx_bytes;
+	stats->rx_bytes = d->rx_bytes;
+	stats->usb_out = d->txns;
+	stats->usb_in = d->txns;
+	stats->wait_ns = d->wait_ns;
+}
+
+static JDVT replay_vtable = {
+	.close = rp_close,
+	.setspeed = rp_setspeed,
+	.commit = rp_commit,
+	.scan_tms = rp_scan_tms,
+	.scan_io = rp_scan_io,
+	.clock = rp_clock,
+	.submit = rp_submit,
+	.wait = rp_wait,
+	.stats = rp_stats,
+};
+
+static void *loadfile(const char *fn, u32 *sz) {
+	int fd;
+	off_t end;
+	void *data = NULL;
+	if ((fd = open(fn, O_RDONLY)) < 0) return NULL;
+	if ((end = lseek(fd, 0, SEEK_END)) < 0) goto oops;
+	if (lseek(fd, 0, SEEK_SET) < 0) goto oops;
+	if ((data = malloc(end + 4)) == NULL) goto oops;
+	if (read(fd, data, end) != end) goto oops;
+	close(fd);
+	*sz = end;
+	return data;
+
+oops:
+	free(data);
+	close(fd);
+	return NULL;
+}
+
+int jtag_replay_open(JTAG **jtag, const char *fn) {
+	const char *s;
+	u32 hdr[2];
+	JDRV *d;
+
+	if ((d = malloc(sizeof(JDRV))) == 0) {
+		return -1;
+	}
+	memset(d, 0, sizeof(JDRV));
+	if ((d->log = loadfile(fn, &d->size)) == NULL) {
+		fprintf(stderr, "jtag-replay: cannot load '%s'\n", fn);
+		goto fail;
+	}
+	if (d->size >= sizeof(hdr))
+		memcpy(hdr, d->log, sizeof(hdr));
+	if ((d->size < sizeof(hdr)) || (hdr[0] != JRPL_MAGIC) || (hdr[1] != JRPL_VERSION)) {
+		fprintf(stderr, "jtag-replay: '%s' is not a capture\n", fn);
+		goto fail;
+	}
+	d->pos = sizeof(hdr);
+	if ((s = getenv("JTAG_REPLAY_LATENCY_US")) != NULL) {
+		d->latency = strtoul(s, 0, 0) * 1000ULL;
+		d->model = 1;
+	}
+	if ((s = getenv("JTAG_REPLAY_KBPS")) != NULL) {
+		d->kbps = strtoul(s, 0, 0);
+		d->model = 1;
+	}
+	if (jtag_init(jtag, d, &replay_vtable)) {
+		goto fail;
+	}
+	return 0;
+fail:
+	free(d->log);
+	free(d);
+	return -1;
+}
@@ -0,0 +1,322 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jtag-driver.h"
+#include "jtag-sim.h"
+
+// Simulated scan chain.  Every TCK is run through the TAP state
+// machine of each device, so the tools can be exercised, and their
+// TCK counts measured, with no hardware at all.
+//
+// JTAG_SIM names the devices, nearest TDO first, separated by commas:
+//   dap        ARM DAP, as on Zynq
+//   xc7z020    Zynq 7020 PL (or xc7z010, xc7a35t, xc7k325t)
+//   zynq       dap,xc7z020
+// JTAG_SIM_APWAIT sets how many TCKs an AP access takes (default 8).
+// JTAG_SIM_APERR=<n> makes every nth AP0 memory access fault.
+// JTAG_SIM_ITRWAIT sets how many TCKs a debug instruction takes (default 0).
+// JTAG_SIM_DTRWAIT adds to the TCKs a debug DTR access takes (default 0).
+
+#define SIM_DEVMAX 8
+
+struct JDRV {
+	SIMDEV *dev[SIM_DEVMAX];
+	u32 count;
+
+	u32 state;
+	u64 tck;
+	u32 commits;
+	int khz;
+	u32 tickets;
+};
+
+static const u8 SIM_NEXT[16][2] = {
+	[JTAG_RESET] = { JTAG_IDLE, JTAG_RESET },
+	[JTAG_IDLE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_DRSELECT] = { JTAG_DRCAPTURE, JTAG_IRSELECT },
+	[JTAG_DRCAPTURE] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DRSHIFT] = { JTAG_DRSHIFT, JTAG_DREXIT1 },
+	[JTAG_DREXIT1] = { JTAG_DRPAUSE, JTAG_DRUPDATE },
+	[JTAG_DRPAUSE] = { JTAG_DRPAUSE, JTAG_DREXIT2 },
+	[JTAG_DREXIT2] = { JTAG_DRSHIFT, JTAG_DRUPDATE },
+	[JTAG_DRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
+	[JTAG_IRSELECT] = { JTAG_IRCAPTURE, JTAG_RESET },
+	[JTAG_IRCAPTURE] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IRSHIFT] = { JTAG_IRSHIFT, JTAG_IREXIT1 },
+	[JTAG_IREXIT1] = { JTAG_IRPAUSE, JTAG_IRUPDATE },
+	[JTAG_IRPAUSE] = { JTAG_IRPAUSE, JTAG_IREXIT2 },
+	[JTAG_IREXIT2] = { JTAG_IRSHIFT, JTAG_IRUPDATE },
+	[JTAG_IRUPDATE] = { JTAG_IDLE, JTAG_DRSELECT },
+};
+
+static void dev_capture_dr(SIMDEV *dev) {
+	dev->shift = NULL;
+	dev->drlen = 0;
+	if (dev->ir == dev->ir_idcode) {
+		dev->dr = dev->idcode;
+		dev->drlen = 32;
+	} else if (dev->ir != ((1 << dev->irsize) - 1)) {
+		dev->capture_dr(dev);
+	}
+	if ((dev->drlen == 0) && (dev->shift == NULL)) {
+		// bypass
+		dev->dr = 0;
+		dev->drlen = 1;
+	}
+}
+
+static u32 dev_shift_dr(SIMDEV *dev, u32 tdi) {
+	u32 tdo;
+	if (dev->shift)
+		return dev->shift(dev, tdi);
+	tdo = dev->dr & 1;
+	dev->dr = (dev->dr >> 1) | (((u64) tdi) << (dev->drlen - 1));
+	return tdo;
+}
+
+// one TCK: returns TDO as sampled on its rising edge
+static u32 sim_clock(JDRV *d, u32 tms, u32 tdi) {
+	SIMDEV *dev;
+	u32 tdo = 0;
+	u32 n, next;
+
+	switch (d->state) {
+	case JTAG_DRCAPTURE:
+		for (n = 0; n < d->count; n++)
+			dev_capture_dr(d->dev[n]);
+		break;
+	case JTAG_IRCAPTURE:
+		for (n = 0; n < d->count; n++)
+			d->dev[n]->irsr = 1;
+		break;
+	case JTAG_DRSHIFT:
+		// TDI enters the device furthest from TDO
+		for (n = d->count; n > 0; n--)
+			tdi = dev_shift_dr(d->dev[n - 1], tdi);
+		tdo = tdi;
+		break;
+	case JTAG_IRSHIFT:
+		for (n = d->count; n > 0; n--) {
+			dev = d->dev[n - 1];
+			next = dev->irsr & 1;
+			dev->irsr = (dev->irsr >> 1) | (tdi << (dev->irsize - 1));
+			tdi = next;
+		}
+		tdo = tdi;
+		break;
+	}
+	d->tck++;
+	next = SIM_NEXT[d->state][tms & 1];
+	if (next != d->state) {
+		// updates and reset take effect on entering the state
+		switch (next) {
+		case JTAG_DRUPDATE:
+			for (n = 0; n < d->count; n++) {
+				dev = d->dev[n];
+				if (dev->update_dr && (dev->ir != dev->ir_idcode))
+					dev->update_dr(dev);
+			}
+			break;
+		case JTAG_IRUPDATE:
+			for (n = 0; n < d->count; n++)
+				d->dev[n]->ir = d->dev[n]->irsr;
+			break;
+		case JTAG_RESET:
+			for (n = 0; n < d->count; n++) {
+				d->dev[n]->ir = d->dev[n]->ir_idcode;
+				if (d->dev[n]->reset)
+					d->dev[n]->reset(d->dev[n]);
+			}
+			break;
+		}
+	}
+	d->state = next;
+	return tdo;
+}
+
+static int sim_setspeed(JDRV *d, int khz) {
+	if (khz >= 0)
+		d->khz = khz;
+	return d->khz;
+}
+
+static int sim_scan_tms(JDRV *d, u32 obit, u32 count, u8 *tbits, u32 ioffset, u8 *ibits) {
+	u32 n, tdo;
+	if (count > 16)
+		return -1;
+	for (n = 0; n < count; n++) {
+		tdo = sim_clock(d, (tbits[n >> 3] >> (n & 7)) & 1, obit);
+		if ((n == 0) && ibits) {
+			ibits[ioffset >> 3] &= ~(1 << (ioffset & 7));
+			ibits[ioffset >> 3] |= tdo << (ioffset & 7);
+		}
+	}
+	return 0;
+}
+
+static int sim_scan_io(JDRV *d, u32 count, u8 *obits, u8 *ibits) {
+	u32 n, tdi, tdo;
+	for (n = 0; n < count; n++) {
+		tdi = obits ? ((obits[n >> 3] >> (n & 7)) & 1) : 0;
+		tdo = sim_clock(d, 0, tdi);
+		if (ibits) {
+			if ((n & 7) == 0)
+				ibits[n >> 3] = 0;
+			ibits[n >> 3] |= tdo << (n & 7);
+		}
+	}
+	return 0;
+}
+
+static int sim_clock_only(JDRV *d, u32 count) {
+	// TMS held low: only IDLE, SHIFT or PAUSE could be sat in
+	while (count-- > 0)
+		sim_clock(d, 0, 0);
+	return 0;
+}
+
+static int sim_commit(JDRV *d) {
+	d->commits++;
+	return 0;
+}
+
+// scans have all completed by the time they are queued
+static int sim_submit(JDRV *d, u32 *ticket) {
+	d->commits++;
+	*ticket = ++d->tickets;
+	return 0;
+}
+
+static int sim_wait(JDRV *d, u32 ticket, int block) {
+	return 1;
+}
+
+static int sim_close(JDRV *d) {
+	u32 n;
+	fprintf(stderr, "jtag-sim: %llu TCKs, %u commits\n",
+		(unsigned long long) d->tck, d->commits);
+	for (n = 0; n < d->count; n++)
+		d->dev[n]->close(d->dev[n]);
+	free(d);
+	return 0;
+}
+
+static JDVT sim_vtable = {
+	.close = sim_close,
+	.setspeed = sim_setspeed,
+	.commit = sim_commit,
+	.scan_tms = sim_scan_tms,
+	.scan_io = sim_scan_io,
+	.clock = sim_clock_only,
+	.submit = sim_submit,
+	.wait = sim_wait,
+};
+
+#define XC7ID(code)	((0x1B<<21)|(0x9<<17)|((code)<<12)|(0x49<<1)|1)
+
+static struct {
+	const char *name;
+	u32 idcode;
+} SIM_XILINX7[] = {
+	{ "xc7z010", XC7ID(0x02) },
+	{ "xc7z020", XC7ID(0x07) },
+	{ "xc7a35t", 0x0362D093 },
+	{ "xc7k325t", 0x03651093 },
+};
+
+static int sim_add(JDRV *d, const char *name, u32 len,
+	u32 apwait, u32 aperr, u32 itrwait, u32 dtrwait) {
+	SIMDEV *dev = NULL;
+	u32 n;
+
+	if ((len == 4) && !memcmp(name, "zynq", 4)) {
+		if (sim_add(d, "dap", 3, apwait, aperr, itrwait, dtrwait))
+			return -1;
+		return sim_add(d, "xc7z020", 7, apwait, aperr, itrwait, dtrwait);
+	}
+	if (d->count == SIM_DEVMAX) {
+		fprintf(stderr, "jtag-sim: too many devices\n");
+		return -1;
+	}
+	if ((len == 3) && !memcmp(name, "dap", 3)) {
+		dev = sim_dap_create(apwait, aperr, itrwait, dtrwait);
+	}
+	for (n = 0; n < sizeof(SIM_XILINX7) / sizeof(SIM_XILINX7[0]); n++) {
+		if ((strlen(SIM_XILINX7[n].name) == len) &&
+			!memcmp(name, SIM_XILINX7[n].name, len)) {
+			dev = sim_xilinx7_create(SIM_XILINX7[n].idcode);
+		}
+	}
+	if (dev == NULL) {
+		fprintf(stderr, "jtag-sim: unknown device '%.*s'\n", (int) len, name);
+		return -1;
+	}
+	dev->tck = &d->tck;
+	dev->ir = dev->ir_idcode;
+	d->dev[d->count++] = dev;
+	return 0;
+}
+
+int jtag_sim_open(JTAG **jtag, const char *chain) {
+	const char *s, *end;
+	u32 apwait = 8;
+	u32 aperr = 0;
+	u32 itrwait = 0;
+	u32 dtrwait = 0;
+	JDRV *d;
+
+	if ((d = malloc(sizeof(JDRV))) == 0) {
+		return -1;
+	}
+	memset(d, 0, sizeof(JDRV));
+	d->state = JTAG_RESET;
+	d->khz = 1000;
+	if ((s = getenv("JTAG_SIM_APWAIT")) != NULL) {
+		apwait = strtoul(s, 0, 0);
+	}
+	if ((s = getenv("JTAG_SIM_APERR")) != NULL) {
+		aperr = strtoul(s, 0, 0);
+	}
+	if ((s = getenv("JTAG_SIM_ITRWAIT")) != NULL) {
+		itrwait = strtoul(s, 0, 0);
+	}
+	if ((s = getenv("JTAG_SIM_DTRWAIT")) != NULL) {
+		dtrwait = strtoul(s, 0, 0);
+	}
+	for (s = chain; *s; s = *end ? end + 1 : end) {
+		if ((end = strchr(s, ',')) == NULL)
+			end = s + strlen(s);
+		if (sim_add(d, s, end - s, apwait, aperr, itrwait, dtrwait))
+			goto fail;
+	}
+	if (d->count == 0) {
+		fprintf(stderr, "jtag-sim: no devices in '%s'\n", chain);
+		goto fail;
+	}
+	if (jtag_init(jtag, d, &sim_vtable)) {
+		goto fail;
+	}
+	return 0;
+fail:
+	while (d->count > 0) {
+		d->count--;
+		d->dev[d->count]->close(d->dev[d->count]);
+	}
+	free(d);
+	return -1;
+}
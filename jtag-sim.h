@@ -0,0 +1,67 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _JTAG_SIM_H_
+#define _JTAG_SIM_H_
+
+#include "jtag.h"
+
+// Devices on the simulated scan chain (see jtag-sim-driver.c).
+//
+// The chain runs the TAP state machine and the instruction register
+// of each device, and IDCODE and BYPASS.  Everything else is up to the
+// device: on Capture-DR it loads dr/drlen for the current instruction
+// (leaving drlen 0 for BYPASS), or sets shift for a register of no
+// fixed length, which is then called for each bit shifted through it.
+
+typedef struct SIMDEV SIMDEV;
+
+struct SIMDEV {
+	const char *name;
+	u32 idcode;
+	u32 irsize;
+	u32 ir_idcode;
+
+	// instruction, and the IR while it is being shifted
+	u32 ir;
+	u32 irsr;
+
+	// data register being shifted, lsb first
+	u64 dr;
+	u32 drlen;
+	u32 (*shift)(SIMDEV *dev, u32 tdi);
+
+	// TCKs since the chain was opened
+	const u64 *tck;
+
+	// Test-Logic-Reset, after ir is back to ir_idcode
+	void (*reset)(SIMDEV *dev);
+	void (*capture_dr)(SIMDEV *dev);
+	void (*update_dr)(SIMDEV *dev);
+	void (*close)(SIMDEV *dev);
+};
+
+// ARM DAP (JTAG-DP, IR 4) with an AHB-AP onto memory as AP0 and an
+// APB-AP as AP1 holding a ROM table and two Cortex-A9 debug units,
+// laid out as on Zynq.  AP accesses take apwait TCKs to complete,
+// if aperr is not 0, every aperr-th AP0 memory access faults,
+// instructions issued through ITR take itrwait TCKs, and debug unit
+// DTR accesses take dtrwait TCKs more.
+SIMDEV *sim_dap_create(u32 apwait, u32 aperr, u32 itrwait, u32 dtrwait);
+
+// Xilinx 7-series TAP (IR 6) with the configuration interface
+// (CFG_IN, CFG_OUT, STAT) and a debug register port on USER4.
+SIMDEV *sim_xilinx7_create(u32 idcode);
+
+#endif
@@ -0,0 +1,276 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "jtag-trace.h"
+
+#define JTRACE_DEFAULT_KB (16 * 1024)
+
+// ring offsets are u32, and head plus a record must not overflow
+#define JTRACE_MAX_KB (1024 * 1024)
+
+struct JTRACE {
+	JTRACE_HDR *hdr;
+	u8 *ring;
+	u32 size;
+	u32 mapped;
+};
+
+static u64 NOW(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) return 0;
+	return (((u64) ts.tv_sec) * ((u64)1000000000)) + ((u64) ts.tv_nsec);
+}
+
+JTRACE *jtrace_open(const char *fn, u32 kbytes) {
+	JTRACE *t;
+	int fd;
+
+	if (kbytes == 0) {
+		kbytes = JTRACE_DEFAULT_KB;
+	}
+	if (kbytes > JTRACE_MAX_KB) {
+		fprintf(stderr, "jtrace: %u KB ring is too large (at most %u)\n",
+			kbytes, JTRACE_MAX_KB);
+		return NULL;
+	}
+	if ((t = malloc(sizeof(JTRACE))) == 0) {
+		return NULL;
+	}
+	t->size = kbytes * 1024;
+	t->mapped = t->size + sizeof(JTRACE_HDR);
+	if ((fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "jtrace: cannot open '%s'\n", fn);
+		goto fail;
+	}
+	if (ftruncate(fd, t->mapped) < 0) {
+		fprintf(stderr, "jtrace: cannot size '%s'\n", fn);
+		close(fd);
+		goto fail;
+	}
+	t->hdr = mmap(NULL, t->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t->hdr == MAP_FAILED) {
+		fprintf(stderr, "jtrace: cannot map '%s'\n", fn);
+		goto fail;
+	}
+	t->ring = (u8*) (t->hdr + 1);
+	memset(t->hdr, 0, sizeof(JTRACE_HDR));
+	t->hdr->magic = JTRACE_MAGIC;
+	t->hdr->version = JTRACE_VERSION;
+	t->hdr->size = t->size;
+	t->hdr->start = NOW();
+	return t;
+fail:
+	free(t);
+	return NULL;
+}
+
+void jtrace_close(JTRACE *t) {
+	if (t) {
+		munmap(t->hdr, t->mapped);
+		free(t);
+	}
+}
+
+// Retire records from the previous lap that [head, head+len) will
+// overwrite.  Once the end of that lap is reached, it is all gone.
+static void jtrace_reclaim(JTRACE *t, u32 len) {
+	JTRACE_HDR *h = t->hdr;
+	JTRACE_REC *r;
+	while (h->wrapped && (h->oldest < (h->head + len))) {
+		r = (void*) (t->ring + h->oldest);
+		if (((t->size - h->oldest) < sizeof(JTRACE_REC)) ||
+			(r->type == JTRACE_WRAP)) {
+			h->wrapped = 0;
+			h->oldest = 0;
+			break;
+		}
+		h->oldest += sizeof(JTRACE_REC) + ((r->len + 7) & (~7));
+		h->lost++;
+	}
+}
+
+void jtrace_add(JTRACE *t, u32 type, const void *data, u32 len) {
+	JTRACE_HDR *h = t->hdr;
+	JTRACE_REC *r;
+	u32 flags = 0;
+	u32 total;
+
+	// no record may take more than half the ring
+	if (len > ((t->size / 2) - sizeof(JTRACE_REC))) {
+		len = (t->size / 2) - sizeof(JTRACE_REC);
+		flags |= JTRACE_F_TRUNC;
+	}
+	total = sizeof(JTRACE_REC) + ((len + 7) & (~7));
+
+	if ((h->head + total) > t->size) {
+		// end this lap: the rest of the ring is unused
+		jtrace_reclaim(t, t->size - h->head);
+		if ((t->size - h->head) >= sizeof(JTRACE_REC)) {
+			r = (void*) (t->ring + h->head);
+			r->type = JTRACE_WRAP;
+			r->flags = 0;
+			r->len = 0;
+			r->ns = 0;
+		}
+		h->head = 0;
+		h->oldest = 0;
+		h->wrapped = 1;
+	}
+	jtrace_reclaim(t, total);
+
+	r = (void*) (t->ring + h->head);
+	// Once the ring has wrapped, the slot still holds a valid type
+	// from the last lap.  Make it the end of a lap while the record
+	// is written, and set the type last, so a crash mid-record
+	// leaves no half-written record marked valid behind.
+	r->type = JTRACE_WRAP;
+	__sync_synchronize();
+	r->flags = flags;
+	r->len = len;
+	r->ns = NOW();
+	memcpy(r + 1, data, len);
+	__sync_synchronize();
+	r->type = type;
+	h->head += total;
+	h->count++;
+}
+
+static void pbin(FILE *fp, u32 val, u32 bits) {
+	u32 n;
+	for (n = 0; n < bits; n++) {
+		fprintf(fp, "%c", (val & 1) ? '1' : '0');
+		val >>= 1;
+	}
+}
+
+// command bytes, including the opcode, of the command at data
+static u32 mpsse_len(const u8 *data, u32 n) {
+	switch (data[0]) {
+	case 0x19: case 0x39:
+		if (n < 3) return n;
+		return 3 + ((data[2] << 8) | data[1]) + 1;
+	case 0x4B: case 0x6B: case 0x1B: case 0x3B: case 0x28:
+	case 0x86: case 0x8F: case 0x80: case 0x82:
+		return 3;
+	case 0x2A: case 0x8E:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+void dismpsse(FILE *fp, const u8 *data, u32 n) {
+	u32 x, i, len;
+	while (n > 0) {
+		len = mpsse_len(data, n);
+		if (len > n) {
+			fprintf(fp, "%02x: <truncated>\n", data[0]);
+			return;
+		}
+		fprintf(fp, "%02x: ", data[0]);
+		switch(data[0]) {
+		case 0x6B: // tms rw
+			fprintf(fp, "x1 <- TDO, ");
+			// fall through
+		case 0x4B: // tms wo
+			fprintf(fp, "TMS <- ");
+			pbin(fp, data[2], data[1] + 1);
+			fprintf(fp, ", TDI <- ");
+			pbin(fp, (data[2] & 0x80) ? 0xFF : 0, data[1] + 1);
+			fprintf(fp, "\n");
+			break;
+		case 0x2A: // ro bits
+			fprintf(fp, "x%d <- TDO\n", data[1] + 1);
+			break;
+		case 0x28: // ro bytes
+			x = ((data[2] << 8) | data[1]) + 1;
+			fprintf(fp, "x%d <- TDO\n", (int) x * 8);
+			break;
+		case 0x1B: // wo bits
+		case 0x3B: // rw bits
+			fprintf(fp, "TDI <- ");
+			pbin(fp, data[2], data[1] + 1);
+			if (data[0] == 0x3B) {
+				fprintf(fp, ", x%d <- TDO\n", data[1] + 1);
+			} else {
+				fprintf(fp, "\n");
+			}
+			break;
+		case 0x19: // wo bytes
+		case 0x39: // rw bytes
+			x = ((data[2] << 8) | data[1]) + 1;
+			fprintf(fp, "TDI <- ");
+			for (i = 0; (i < x) && (i < 16); i++) pbin(fp, data[3+i], 8);
+			if (x > 16) {
+				fprintf(fp, "... (%d bits)", (int) x * 8);
+			}
+			if (data[0] == 0x39) {
+				fprintf(fp, ", x%d <- TDO\n", (int) x * 8);
+			} else {
+				fprintf(fp, "\n");
+			}
+			break;
+		case 0x8E:
+			fprintf(fp, "CLOCK x%d\n", data[1] + 1);
+			break;
+		case 0x8F:
+			x = ((data[2] << 8) | data[1]) + 1;
+			fprintf(fp, "CLOCK x%d\n", (int) x * 8);
+			break;
+		case 0x86:
+			fprintf(fp, "DIVISOR %d\n", (data[2] << 8) | data[1]);
+			break;
+		case 0x8A:
+			fprintf(fp, "CLKDIV5 OFF\n");
+			break;
+		case 0x8B:
+			fprintf(fp, "CLKDIV5 ON\n");
+			break;
+		case 0x96:
+			fprintf(fp, "ADAPTIVE ON\n");
+			break;
+		case 0x97:
+			fprintf(fp, "ADAPTIVE OFF\n");
+			break;
+		case 0x80:
+		case 0x82:
+			fprintf(fp, "GPIO%s VAL %02x DIR %02x\n",
+				(data[0] == 0x80) ? "L" : "H", data[1], data[2]);
+			break;
+		case 0x84:
+			fprintf(fp, "LOOPBACK ON\n");
+			break;
+		case 0x85:
+			fprintf(fp, "LOOPBACK OFF\n");
+			break;
+		case 0x87:
+			fprintf(fp, "FLUSH\n");
+			break;
+		default:
+			fprintf(fp, "???\n");
+			return;
+		}
+		data += len;
+		n -= len;
+	}
+}
@@ -0,0 +1,76 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _JTAG_TRACE_H_
+#define _JTAG_TRACE_H_
+
+#include <stdio.h>
+
+#include "jtag.h"
+
+// Binary trace of driver traffic, written to a ring buffer in an
+// mmap'd file so that recording it costs a memcpy.  Enabled at runtime
+// by setting JTAG_TRACE to the file to use (and optionally JTAG_TRACE_KB
+// to its size), decoded offline by the jtrace tool.
+
+#define JTRACE_MAGIC	0x4352544A // "JTRC"
+#define JTRACE_VERSION	1
+
+// File layout: a header, then the ring.
+// If wrapped, the records run from oldest up to the end of that lap
+// (a WRAP record, or less than a record header left) then from 0 to head.
+// Otherwise they run from 0 to head.
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 size; // bytes in the ring
+	u32 head; // offset of the next record
+	u32 oldest; // offset of the oldest record, if wrapped
+	u32 wrapped;
+	u64 count; // records written
+	u64 lost; // records overwritten
+	u64 start; // timestamp (ns) when opened
+	u8 reserved[16];
+} JTRACE_HDR;
+
+// each record is a header, then len bytes, padded to 8 bytes
+typedef struct {
+	u16 type;
+	u16 flags;
+	u32 len;
+	u64 ns; // CLOCK_MONOTONIC_RAW
+} JTRACE_REC;
+
+#define JTRACE_WRAP	0 // end of a lap, continue at offset 0
+#define JTRACE_TX	1 // command bytes of one bulk OUT transfer
+#define JTRACE_RX	2 // reply bytes of a txn (status headers stripped)
+#define JTRACE_TXN	3 // txn queued: u32 command bytes, u32 reply bytes
+#define JTRACE_USBIN	4 // bulk IN transfer completed: u32 raw length
+#define JTRACE_COMMIT	5 // commit or submit begins: u32 0 or 1 (submit)
+#define JTRACE_DONE	6 // commit, submit or wait ends: s32 status
+#define JTRACE_WAIT	7 // wait begins: u32 ticket
+
+#define JTRACE_F_TRUNC	1 // data was cut short to fit the ring
+
+typedef struct JTRACE JTRACE;
+
+// returns NULL (after complaining) if the file cannot be set up
+JTRACE *jtrace_open(const char *fn, u32 kbytes);
+void jtrace_close(JTRACE *t);
+void jtrace_add(JTRACE *t, u32 type, const void *data, u32 len);
+
+// display mpsse command stream in a (sortof) human readable form
+void dismpsse(FILE *fp, const u8 *data, u32 n);
+
+#endif
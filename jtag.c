@@ -15,7 +15,7 @@ int main(int argc, char **argv) {
 	unsigned char C;
 	JTAG *jtag;
 
-	if (jtag_mpsse_open(&jtag)) {
+	if (jtag_open(&jtag)) {
 		fprintf(stderr, "error opening jtag\n");
 		return -1;
 	}
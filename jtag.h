@@ -41,8 +41,28 @@ typedef struct JTAG JTAG;
 
 int jtag_mpsse_open(JTAG **jtag);
 
+// Log every scan and commit made through the mpsse driver, and the
+// TDO data each one returned, to fn.
+int jtag_capture_open(JTAG **jtag, const char *fn);
+
+// Answer scans from a log made by jtag_capture_open(), with no
+// hardware attached.  The scans made must match those captured.
+int jtag_replay_open(JTAG **jtag, const char *fn);
+
+// Simulate a scan chain, TCK by TCK (see jtag-sim-driver.c for how
+// chain names the devices on it).
+int jtag_sim_open(JTAG **jtag, const char *chain);
+
+// Open whichever backend the environment asks for:
+// JTAG_SIM=<chain> simulates, JTAG_REPLAY=<log> replays,
+// JTAG_CAPTURE=<log> captures, otherwise the mpsse driver.
+int jtag_open(JTAG **jtag);
+
 void jtag_close(JTAG *jtag);
 
+// returns actual speed in kHz, negative on error
+// khz == 0 selects adaptive clocking (TCK paced by RTCK) where supported
+// khz < 0 only queries the current speed
 int jtag_setspeed(JTAG *jtag, int khz);
 
 // which state to arrive at upon completion of jtag_ir_*()
@@ -61,9 +81,13 @@ void jtag_set_dr_postfix(JTAG *jtag, unsigned count, const void *bits);
 // idle states
 void jtag_clear_state(JTAG *jtag);
 
-// Move jtag state machine from current state to new state.
+// Move jtag state machine from current state to new state,
+// along the shortest path.  Any state may be reached from any other.
 // Moving to JTAG_RESET will work even if current state
 // is out of sync.
+// State motion is held back and sent along with the next scan,
+// idle, or commit.  Between back-to-back scans the path may go
+// from UPDATE straight on to the next scan, skipping the idle state.
 void jtag_goto(JTAG *jtag, unsigned state);
 
 // Move to IRSHIFT, shift count bits, then move to after_ir state.
@@ -77,10 +101,72 @@ void jtag_dr_rd(JTAG *jtag, unsigned count, void *rbits);
 void jtag_dr_io(JTAG *jtag, unsigned count, const void *wbits, void *rbits);
 
 // Move to IDLE and stay there for count clocks
+// Long waits are cheap: drivers that can clock without shifting
+// do so, costing a few bytes rather than a command per few clocks.
 void jtag_idle(JTAG *jtag, unsigned count);
 
 int jtag_commit(JTAG *jtag);
 
+// Like jtag_commit(), but returns as soon as the scans are queued to
+// the device, with a ticket for them in *ticket.  Buffers passed to
+// jtag_*() since the last commit or submit must stay valid, and read
+// data is not there yet, until jtag_wait() on the ticket returns.
+// Tickets complete in the order submitted, so waiting on one also
+// waits on those submitted before it.
+int jtag_submit(JTAG *jtag, unsigned *ticket);
+
+// Block until the ticket completes. Returns 0 on success, negative
+// if its scans (or any before them still in flight) failed.
+int jtag_wait(JTAG *jtag, unsigned ticket);
+
+// Wait on several tickets, negative if any of them failed.
+int jtag_wait_all(JTAG *jtag, const unsigned *ticket, int count);
+
+// Returns 1 if the ticket has completed, 0 if not yet, negative on error.
+int jtag_poll(JTAG *jtag, unsigned ticket);
+
+// Recorded programs:
+// Scans issued between jtag_prog_begin() and jtag_prog_end() are not
+// queued, but recorded into a program, which jtag_prog_run() queues
+// as if they had been issued again.  The MPSSE driver encodes the
+// program once, so running it is a copy of prebuilt commands.
+// Recording may not span a commit.
+//
+// Each jtag_ir_*() or jtag_dr_*() call recorded is numbered from 0.
+// jtag_prog_patch() replaces the data written by scan n (same bit
+// count as recorded) and jtag_prog_bind() redirects where the data
+// read by scan n lands.  Unless rebound, reads land in the buffers
+// passed when recording, and those must still be valid when run.
+typedef struct JPROG JPROG;
+
+int jtag_prog_begin(JTAG *jtag);
+JPROG *jtag_prog_end(JTAG *jtag);
+int jtag_prog_run(JTAG *jtag, JPROG *prog);
+int jtag_prog_patch(JTAG *jtag, JPROG *prog, unsigned n, const void *wbits);
+int jtag_prog_bind(JTAG *jtag, JPROG *prog, unsigned n, void *rbits);
+void jtag_prog_free(JTAG *jtag, JPROG *prog);
+
+// Counters kept since the JTAG was opened, or since the last
+// jtag_reset_stats().  The driver fills in the second group, and
+// leaves at 0 whatever it has no such thing as.
+typedef struct {
+	u64 commits;	// jtag_commit()s and jtag_submit()s
+	u64 tcks;	// TCK cycles clocked
+	u64 bits;	// bits shifted by jtag_ir_*() and jtag_dr_*(),
+			// not counting prefix and postfix bits
+
+	u64 tx_bytes;	// command bytes sent to the probe
+	u64 rx_bytes;	// TDO bytes read back from it
+	u64 usb_out;	// USB transfers to and from the probe
+	u64 usb_in;
+	u64 implicit;	// transactions sent because the command buffer
+			// filled mid-scan, rather than by a commit
+	u64 wait_ns;	// time spent blocked on USB
+} JTAG_STATS;
+
+void jtag_get_stats(JTAG *jtag, JTAG_STATS *stats);
+void jtag_reset_stats(JTAG *jtag);
+
 typedef struct {
 	unsigned idcode;
 	unsigned idmask;
@@ -95,6 +181,12 @@ int jtag_enumerate(JTAG *jtag);
 
 void jtag_print_chain(JTAG *jtag);
 
+// Step TCK up towards maxkhz, checking at each speed that a known
+// pattern survives a trip through the IDCODE registers of the chain.
+// Leaves the fastest error-free speed set and returns it, negative
+// on error.  Enumerates the chain, so clears state like jtag_enumerate.
+int jtag_calibrate(JTAG *jtag, int maxkhz);
+
 // get information about the nth device on the chain
 JTAG_INFO *jtag_get_nth_device(JTAG *jtag, int n);
 
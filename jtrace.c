@@ -0,0 +1,239 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jtag-trace.h"
+
+// decoder for the traces written when JTAG_TRACE is set
+
+static const char *TYPE[] = {
+	"WRAP", "TX", "RX", "TXN", "USBIN", "COMMIT", "DONE", "WAIT",
+};
+
+#define TYPES (sizeof(TYPE) / sizeof(TYPE[0]))
+
+static int summary;
+static u64 t0;
+
+// totals for the summary
+static u64 count[TYPES];
+static u64 bytes[TYPES];
+static u64 commits, commit_ns, commit_max;
+static u64 begin_ns, last_ns, stall_ns, stall_at;
+static int busy;
+
+// TX records following a TXN are segments of one command stream,
+// which may split a command from its payload; join them up
+static u8 *txbuf;
+static u32 txlen, txwant;
+
+static void hexdump(const u8 *x, u32 len) {
+	u32 n;
+	for (n = 0; (n < len) && (n < 64); n++) {
+		printf("%s%02x", (n & 15) ? " " : "    ", x[n]);
+		if ((n & 15) == 15) printf("\n");
+	}
+	if (len > 64) {
+		printf("    ... (%u bytes)\n", (unsigned) len);
+	} else if (n & 15) {
+		printf("\n");
+	}
+}
+
+static u32 word(const JTRACE_REC *r, u32 n) {
+	u32 x = 0;
+	if (r->len >= ((n + 1) * 4)) {
+		memcpy(&x, ((u8*) (r + 1)) + n * 4, 4);
+	}
+	return x;
+}
+
+static void record(const JTRACE_REC *r) {
+	const u8 *data = (const u8*) (r + 1);
+
+	if (r->type < TYPES) {
+		count[r->type]++;
+		bytes[r->type] += r->len;
+	}
+	// longest silence while a commit was waiting on the device
+	if (busy && last_ns && ((r->ns - last_ns) > stall_ns)) {
+		stall_ns = r->ns - last_ns;
+		stall_at = last_ns;
+	}
+	last_ns = r->ns;
+	switch (r->type) {
+	case JTRACE_COMMIT:
+	case JTRACE_WAIT:
+		begin_ns = r->ns;
+		busy = 1;
+		break;
+	case JTRACE_DONE:
+		if (busy) {
+			commits++;
+			commit_ns += r->ns - begin_ns;
+			if ((r->ns - begin_ns) > commit_max) {
+				commit_max = r->ns - begin_ns;
+			}
+		}
+		busy = 0;
+		break;
+	}
+	if (summary) {
+		return;
+	}
+
+	printf("%12.3f %-6s", (r->ns - t0) / 1000.0,
+		(r->type < TYPES) ? TYPE[r->type] : "???");
+	switch (r->type) {
+	case JTRACE_TX:
+		printf(" %u bytes%s\n", (unsigned) r->len,
+			(r->flags & JTRACE_F_TRUNC) ? " (truncated)" : "");
+		if (txwant == 0) {
+			dismpsse(stdout, data, r->len);
+			break;
+		}
+		if ((r->len > (txwant - txlen)) || (r->flags & JTRACE_F_TRUNC)) {
+			// does not fit what the txn announced
+			dismpsse(stdout, txbuf, txlen);
+			dismpsse(stdout, data, r->len);
+			txwant = 0;
+			break;
+		}
+		memcpy(txbuf + txlen, data, r->len);
+		txlen += r->len;
+		if (txlen == txwant) {
+			dismpsse(stdout, txbuf, txlen);
+			txwant = 0;
+		}
+		break;
+	case JTRACE_RX:
+		printf(" %u bytes%s\n", (unsigned) r->len,
+			(r->flags & JTRACE_F_TRUNC) ? " (truncated)" : "");
+		hexdump(data, r->len);
+		break;
+	case JTRACE_TXN:
+		printf(" tx %u rx %u\n", word(r, 0), word(r, 1));
+		if (txwant) {
+			dismpsse(stdout, txbuf, txlen);
+		}
+		txlen = 0;
+		txwant = 0;
+		if ((txbuf = realloc(txbuf, word(r, 0))) != NULL) {
+			txwant = word(r, 0);
+		}
+		break;
+	case JTRACE_USBIN:
+		printf(" %u bytes\n", word(r, 0));
+		break;
+	case JTRACE_COMMIT:
+		printf(" %s\n", word(r, 0) ? "submit" : "commit");
+		break;
+	case JTRACE_WAIT:
+		printf(" ticket %u\n", word(r, 0));
+		break;
+	case JTRACE_DONE:
+		printf(" status %d\n", (int) word(r, 0));
+		break;
+	default:
+		printf(" %u bytes\n", (unsigned) r->len);
+	}
+}
+
+// walk records in [off, end), stopping at the end of a lap
+static void walk(const u8 *ring, u32 size, u32 off, u32 end) {
+	const JTRACE_REC *r;
+	while ((off < end) && ((size - off) >= sizeof(JTRACE_REC))) {
+		r = (const void*) (ring + off);
+		if (r->type == JTRACE_WRAP) {
+			return;
+		}
+		off += sizeof(JTRACE_REC) + ((r->len + 7) & (~7));
+		if (off > size) {
+			return;
+		}
+		record(r);
+	}
+}
+
+int main(int argc, char **argv) {
+	const JTRACE_HDR *h;
+	const u8 *ring;
+	struct stat st;
+	void *map;
+	u64 n;
+	int fd;
+
+	if ((argc == 3) && !strcmp(argv[1], "-s")) {
+		summary = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "usage: jtrace [-s] <tracefile>\n");
+		return -1;
+	}
+	if ((fd = open(argv[1], O_RDONLY)) < 0) {
+		fprintf(stderr, "jtrace: cannot open '%s'\n", argv[1]);
+		return -1;
+	}
+	if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(JTRACE_HDR))) {
+		fprintf(stderr, "jtrace: '%s' is not a trace\n", argv[1]);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "jtrace: cannot map '%s'\n", argv[1]);
+		return -1;
+	}
+	h = map;
+	ring = (const u8*) (h + 1);
+	if ((h->magic != JTRACE_MAGIC) || (h->version != JTRACE_VERSION) ||
+		((h->size + sizeof(JTRACE_HDR)) > st.st_size)) {
+		fprintf(stderr, "jtrace: '%s' is not a trace\n", argv[1]);
+		return -1;
+	}
+	t0 = h->start;
+	if (h->wrapped) {
+		walk(ring, h->size, h->oldest, h->size);
+	}
+	walk(ring, h->size, 0, h->head);
+
+	printf("records: %llu written, %llu overwritten\n",
+		(unsigned long long) h->count, (unsigned long long) h->lost);
+	for (n = 1; n < TYPES; n++) {
+		if (count[n]) {
+			printf("%-6s %10llu records %12llu bytes\n", TYPE[n],
+				(unsigned long long) count[n],
+				(unsigned long long) bytes[n]);
+		}
+	}
+	if (commits) {
+		printf("waits: %llu, average %.3f us, longest %.3f us\n",
+			(unsigned long long) commits,
+			(commit_ns / (double) commits) / 1000.0,
+			commit_max / 1000.0);
+		printf("longest stall while waiting: %.3f us at %.3f us\n",
+			stall_ns / 1000.0, (stall_at - t0) / 1000.0);
+	}
+	return 0;
+}
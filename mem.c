@@ -12,26 +12,220 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "dap.h"
 
+static u64 NOW(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) return 0;
+	return (((u64) ts.tv_sec) * ((u64)1000000000)) + ((u64) ts.tv_nsec);
+}
+
+// mem watch <file> <seconds> <addr>...
+// Samples the words while the target runs, into file: "DAPW", the
+// count of words and their addresses (u32 each), then a record per
+// sample of u64 ns since the start and the u32 words, all in host
+// byte order.
+typedef struct {
+	FILE *fp;
+	u32 count;
+	u64 start;
+	u64 end;
+	u64 samples;
+	int error;
+} WATCH;
+
+static int watch_sample(void *cookie, u64 ns, u32 *val) {
+	WATCH *w = cookie;
+	ns -= w->start;
+	if ((fwrite(&ns, sizeof(ns), 1, w->fp) != 1) ||
+		(fwrite(val, sizeof(u32), w->count, w->fp) != w->count)) {
+		w->error = 1;
+		return 1;
+	}
+	w->samples++;
+	// the clock is only read every so often
+	if ((w->samples & 1023) == 0) {
+		return NOW() >= w->end;
+	}
+	return 0;
+}
+
+static int watch(DAP *dap, int argc, char **argv) {
+	u32 addr[DAP_SAMPLE_MAX];
+	WATCH w;
+	double secs;
+	int n;
+
+	if ((argc < 4) || ((argc - 3) > DAP_SAMPLE_MAX)) {
+		fprintf(stderr, "usage: mem watch <file> <seconds> <addr>...\n");
+		return -1;
+	}
+	memset(&w, 0, sizeof(w));
+	w.count = argc - 3;
+	for (n = 0; n < w.count; n++) {
+		addr[n] = strtoul(argv[n + 3], 0, 0);
+	}
+	if ((w.fp = fopen(argv[1], "wb")) == NULL) {
+		fprintf(stderr, "error: cannot open '%s'\n", argv[1]);
+		return -1;
+	}
+	fwrite("DAPW", 4, 1, w.fp);
+	fwrite(&w.count, sizeof(u32), 1, w.fp);
+	fwrite(addr, sizeof(u32), w.count, w.fp);
+	w.start = NOW();
+	w.end = w.start + (u64) (strtod(argv[2], 0) * 1000000000.0);
+	n = dap_mem_sample(dap, 0, addr, w.count, watch_sample, &w);
+	if (fclose(w.fp) || w.error) {
+		fprintf(stderr, "error: cannot write '%s'\n", argv[1]);
+		return -1;
+	}
+	if (n) {
+		fprintf(stderr, "error: sampling failed\n");
+		return -1;
+	}
+	secs = (NOW() - w.start) / 1000000000.0;
+	fprintf(stderr, "%llu samples in %.2fs, %.0f/s\n",
+		(unsigned long long) w.samples, secs, w.samples / secs);
+	return 0;
+}
+
+// mem dump [-s] <file> <addr> <len>
+// Reads memory straight into the file, mapped, a chunk at a time, and
+// has the page cache start writing each chunk out as the next one is
+// read.  Progress is kept in <file>.resume, so a dump that fails part
+// way picks up where it stopped when run again.  With -s, chunks that
+// read as all zero are left as holes.
+#define DUMP_CHUNK	(1024 * 1024)
+
+static int dump_zero(u8 *data, u32 len) {
+	while (len-- > 0) {
+		if (*data++) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void dump_progress(const char *fn, u32 addr, u32 len, u32 done) {
+	FILE *fp;
+	if ((fp = fopen(fn, "w")) == NULL) {
+		return;
+	}
+	fprintf(fp, "%08x %08x %08x\n", addr, len, done);
+	fclose(fp);
+}
+
+static int dump(DAP *dap, int argc, char **argv) {
+	char rfn[1024];
+	unsigned a, l, d;
+	u32 addr, len, done = 0, start, n;
+	int sparse = 0, fd, r = -1;
+	struct stat st;
+	double secs;
+	FILE *fp;
+	u8 *map;
+	u64 t0;
+
+	if ((argc > 1) && !strcmp(argv[1], "-s")) {
+		sparse = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 4) {
+		fprintf(stderr, "usage: mem dump [-s] <file> <addr> <len>\n");
+		return -1;
+	}
+	addr = strtoul(argv[2], 0, 0);
+	len = strtoul(argv[3], 0, 0);
+	if (len == 0) {
+		return 0;
+	}
+	snprintf(rfn, sizeof(rfn), "%s.resume", argv[1]);
+	if ((fp = fopen(rfn, "r")) != NULL) {
+		if ((fscanf(fp, "%x %x %x", &a, &l, &d) == 3) &&
+			(a == addr) && (l == len) && (d <= len)) {
+			done = d;
+		}
+		fclose(fp);
+	}
+	// nothing to resume unless the file is still the right size
+	if (done && ((stat(argv[1], &st) != 0) || (st.st_size != len))) {
+		done = 0;
+	}
+	if ((fd = open(argv[1], O_RDWR | O_CREAT | (done ? 0 : O_TRUNC), 0644)) < 0) {
+		fprintf(stderr, "error: cannot open '%s'\n", argv[1]);
+		return -1;
+	}
+	if (ftruncate(fd, len)) {
+		fprintf(stderr, "error: cannot size '%s'\n", argv[1]);
+		close(fd);
+		return -1;
+	}
+	if ((map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "error: cannot map '%s'\n", argv[1]);
+		close(fd);
+		return -1;
+	}
+	if (done) {
+		fprintf(stderr, "resuming at %08x\n", addr + done);
+	}
+	t0 = NOW();
+	for (start = done; done < len; done += n) {
+		n = ((len - done) > DUMP_CHUNK) ? DUMP_CHUNK : (len - done);
+		if (dap_mem_read(dap, 0, addr + done, map + done, n)) {
+			fprintf(stderr, "error: read failed at %08x, run again to resume\n",
+				addr + done);
+			goto out;
+		}
+		if (sparse && dump_zero(map + done, n)) {
+			fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, done, n);
+		} else {
+			msync(map + done, n, MS_ASYNC);
+		}
+		dump_progress(rfn, addr, len, done + n);
+	}
+	if (msync(map, len, MS_SYNC)) {
+		fprintf(stderr, "error: cannot write '%s'\n", argv[1]);
+		goto out;
+	}
+	unlink(rfn);
+	secs = (NOW() - t0) / 1000000000.0;
+	fprintf(stderr, "%u bytes in %.2fs, %.2f MB/s\n", len - start, secs,
+		(len - start) / (secs * 1000000.0));
+	r = 0;
+out:
+	munmap(map, len);
+	close(fd);
+	return r;
+}
+
 int main(int argc, char **argv) {
 	JTAG *jtag;
 	DAP *dap;
 
 	if (argc < 2) return -1;
 
-	if (jtag_mpsse_open(&jtag)) return -1;
+	if (jtag_open(&jtag)) return -1;
 	if ((dap = dap_init(jtag, 0x4ba00477)) == NULL) return -1;
 	if (dap_attach(dap)) return -1;
 
-	if (argc == 2) {
+	if (!strcmp(argv[1], "watch")) {
+		return watch(dap, argc - 1, argv + 1);
+	} else if (!strcmp(argv[1], "dump")) {
+		return dump(dap, argc - 1, argv + 1);
+	} else if (argc == 2) {
 		u32 x;
 		if (dap_mem_rd32(dap, 0, strtoul(argv[1], 0, 0), &x)) return -1;
 		printf("%08x\n", x);
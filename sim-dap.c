@@ -0,0 +1,528 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jtag-sim.h"
+#include "dap-registers.h"
+#include "v7debug-registers.h"
+
+// Simulated ARM DAP, as found on Zynq:
+//   AP0  AHB-AP onto memory (sparse, any address is RAM), taking
+//        byte, halfword, and packed accesses
+//   AP1  APB-AP onto the debug bus: a ROM table at 0x80000000 and
+//        Cortex-A9 debug units at 0x80090000 and 0x80092000
+//
+// As with the real thing, the ack captured by a DPACC/APACC scan says
+// whether the previous access has completed.  If not, it is WAIT, the
+// access shifted in is dropped, and with ORUNDETECT set STICKYORUN is
+// raised and further AP accesses are dropped until it is cleared.
+// TRNMODE may be set to pushed verify, for which AP writes read
+// and compare instead, raising STICKYCMP on a mismatch.
+// With aperr set, every aperr-th memory access through AP0 faults,
+// as a marginal link or bus might: it is not done, and STICKYERR is
+// raised.
+// The debug units are in non-blocking DCC mode: a DTRRX write while
+// RXFULL is set is dropped, as is an ITR write while the last
+// instruction is still running.  With itrwait set, an instruction
+// takes that many TCKs, and only then do its results show.  A DTRTX
+// read with nothing in it returns 0, and with dtrwait set, DTR
+// accesses take that many TCKs more than others.
+
+#define DAP_IDCODE	0x4ba00477
+
+#define AHB_AP_IDR	0x24770011
+#define APB_AP_IDR	0x44770002
+#define APB_ROM		0x80000000
+#define APB_CPU0	0x80090000
+#define APB_CPU1	0x80092000
+
+#define CTRL_WRITABLE	(DPCSW_CSYSPWRUPREQ | DPCSW_CDBGPWRUPREQ | \
+			DPCSW_CDBGRSTREQ | DPCSW_TRNCNT(0x3FF) | \
+			DPCSW_MASKLANE(0xF) | (3 << 2) | DPCSW_ORUNDETECT)
+#define CTRL_STICKY	(DPCSW_STICKYERR | DPCSW_STICKYCMP | DPCSW_STICKYORUN)
+
+#define DSCR_WRITABLE	(DSCR_DCC_MASK | DSCR_M_DBG_EN | DSCR_H_DBG_EN | \
+			DSCR_ITR_EN | DSCR_UDCC_DIS | DSCR_INT_DIS | DSCR_DBG_ACK)
+
+typedef struct {
+	u32 r[16];
+	u32 cpsr;
+	u32 dscr;
+	u32 dtrrx;
+	u32 dtrtx;
+	u32 halted;
+	u32 itrwait;
+	u32 busy; // instr is in flight until done
+	u32 instr;
+	u64 done;
+} SIMCPU;
+
+typedef struct {
+	u32 csw;
+	u32 tar;
+} SIMAP;
+
+typedef struct {
+	SIMDEV dev;
+	u32 apwait;
+	u32 aperr;
+	u32 dtrwait;
+	u32 accesses; // through AP0 DRW, counting to aperr
+
+	// DP
+	u32 ctrl;
+	u32 select;
+	u32 rdata; // result of the last access, for the next capture
+	u32 waited; // WAIT was captured, drop this scan's access
+	u64 busy; // AP access in progress until this TCK
+
+	SIMAP ap[2];
+
+	// AP0 memory, 4K pages allocated on first write
+	u8 **dir[1024];
+
+	SIMCPU cpu[2];
+} SIMDAP;
+
+static u8 *mem_page(SIMDAP *dap, u32 addr, int alloc) {
+	u8 **dir = dap->dir[addr >> 22];
+	u8 *page;
+	if (dir == NULL) {
+		if (!alloc || ((dir = calloc(1024, sizeof(u8*))) == NULL))
+			return NULL;
+		dap->dir[addr >> 22] = dir;
+	}
+	page = dir[(addr >> 12) & 0x3FF];
+	if (page == NULL) {
+		if (!alloc || ((page = calloc(1, 4096)) == NULL))
+			return NULL;
+		dir[(addr >> 12) & 0x3FF] = page;
+	}
+	return page;
+}
+
+// bytes is 1, 2 or 4 and addr aligned to it; data is in its byte lanes
+static u32 mem_rd(SIMDAP *dap, u32 addr, u32 bytes) {
+	u8 *page = mem_page(dap, addr, 0);
+	u32 n, val = 0;
+	if (page == NULL)
+		return 0;
+	for (n = 0; n < bytes; n++)
+		val |= page[(addr + n) & 0xFFF] << (8 * ((addr + n) & 3));
+	return val;
+}
+
+static void mem_wr(SIMDAP *dap, u32 addr, u32 bytes, u32 val) {
+	u8 *page = mem_page(dap, addr, 1);
+	u32 n;
+	if (page == NULL)
+		return;
+	for (n = 0; n < bytes; n++)
+		page[(addr + n) & 0xFFF] = val >> (8 * ((addr + n) & 3));
+}
+
+// ---- Cortex-A9 debug unit ----
+
+#define ARM_MOV_DCC_Rx		0xEE000E15
+#define ARM_MOV_Rx_DCC		0xEE100E15
+#define ARM_MOV_R0_PC		0xE1A0000F
+#define ARM_MOV_PC_R0		0xE1A0F000
+#define ARM_MOV_CPSR_R0		0xE129F000
+#define ARM_MOV_R0_CPSR		0xE10F0000
+
+static void cpu_exec(SIMCPU *cpu, u32 instr) {
+	u32 x = (instr >> 12) & 15;
+	if ((instr & 0xFFFF0FFF) == ARM_MOV_DCC_Rx) {
+		cpu->dtrtx = (x == 15) ? (cpu->r[15] + 8) : cpu->r[x];
+		cpu->dscr |= DSCR_TXFULL;
+	} else if ((instr & 0xFFFF0FFF) == ARM_MOV_Rx_DCC) {
+		cpu->r[x] = cpu->dtrrx;
+		cpu->dscr &= ~DSCR_RXFULL;
+	} else if (instr == ARM_MOV_R0_PC) {
+		cpu->r[0] = cpu->r[15] + 8;
+	} else if (instr == ARM_MOV_PC_R0) {
+		cpu->r[15] = cpu->r[0];
+	} else if (instr == ARM_MOV_R0_CPSR) {
+		cpu->r[0] = cpu->cpsr;
+	} else if (instr == ARM_MOV_CPSR_R0) {
+		cpu->cpsr = cpu->r[0];
+	}
+	// anything else (barriers, cache maintenance) does nothing here
+}
+
+static void cpu_settle(SIMCPU *cpu, u64 now) {
+	if (cpu->busy && (now >= cpu->done)) {
+		cpu->busy = 0;
+		cpu_exec(cpu, cpu->instr);
+	}
+}
+
+static u32 cpu_rd(SIMCPU *cpu, u32 off, u64 now) {
+	u32 x;
+	cpu_settle(cpu, now);
+	switch (off) {
+	case DBGDSCR:
+		x = cpu->dscr | (cpu->busy ? 0 : DSCR_INSTRCOMPL);
+		return x | (cpu->halted ? DSCR_HALTED : DSCR_RESTARTED);
+	case DBGDTRTX:
+		if (!(cpu->dscr & DSCR_TXFULL))
+			return 0;
+		cpu->dscr &= ~DSCR_TXFULL;
+		return cpu->dtrtx;
+	case DBGDEVTYPE:
+		return 0x15;
+	case 0xFE0: return 0x09;
+	case 0xFE4: return 0xBC;
+	case 0xFE8: return 0x0B;
+	case 0xFD0: return 0x04;
+	case 0xFF0: return 0x0D;
+	case 0xFF4: return 0x90;
+	case 0xFF8: return 0x05;
+	case 0xFFC: return 0xB1;
+	}
+	return 0;
+}
+
+static void cpu_wr(SIMCPU *cpu, u32 off, u32 val, u64 now) {
+	cpu_settle(cpu, now);
+	switch (off) {
+	case DBGDSCR:
+		cpu->dscr = (cpu->dscr & ~DSCR_WRITABLE) | (val & DSCR_WRITABLE);
+		break;
+	case DBGDRCR:
+		if (val & DRCR_HALT_REQ)
+			cpu->halted = 1;
+		if (val & DRCR_START_REQ)
+			cpu->halted = 0;
+		break;
+	case DBGITR:
+		if (!cpu->halted || !(cpu->dscr & DSCR_ITR_EN) || cpu->busy)
+			break;
+		if (cpu->itrwait == 0) {
+			cpu_exec(cpu, val);
+			break;
+		}
+		cpu->busy = 1;
+		cpu->instr = val;
+		cpu->done = now + cpu->itrwait;
+		break;
+	case DBGDTRRX:
+		if (cpu->dscr & DSCR_RXFULL)
+			break;
+		cpu->dtrrx = val;
+		cpu->dscr |= DSCR_RXFULL;
+		break;
+	}
+}
+
+// ---- debug bus ----
+
+static u32 rom_rd(u32 off) {
+	switch (off) {
+	case 0x000: return (APB_CPU0 - APB_ROM) | 3;
+	case 0x004: return (APB_CPU1 - APB_ROM) | 3;
+	case 0xFE0: return 0xA1;
+	case 0xFE4: return 0xB4;
+	case 0xFE8: return 0x0B;
+	case 0xFD0: return 0x04;
+	case 0xFF0: return 0x0D;
+	case 0xFF4: return 0x10;
+	case 0xFF8: return 0x05;
+	case 0xFFC: return 0xB1;
+	}
+	return 0;
+}
+
+static u32 apb_rd(SIMDAP *dap, u32 addr) {
+	if ((addr & 0xFFFFF000) == APB_ROM)
+		return rom_rd(addr & 0xFFC);
+	if ((addr & 0xFFFFF000) == APB_CPU0)
+		return cpu_rd(dap->cpu + 0, addr & 0xFFC, *dap->dev.tck);
+	if ((addr & 0xFFFFF000) == APB_CPU1)
+		return cpu_rd(dap->cpu + 1, addr & 0xFFC, *dap->dev.tck);
+	return 0;
+}
+
+static void apb_wr(SIMDAP *dap, u32 addr, u32 val) {
+	if ((addr & 0xFFFFF000) == APB_CPU0)
+		cpu_wr(dap->cpu + 0, addr & 0xFFC, val, *dap->dev.tck);
+	if ((addr & 0xFFFFF000) == APB_CPU1)
+		cpu_wr(dap->cpu + 1, addr & 0xFFC, val, *dap->dev.tck);
+}
+
+// ---- access ports ----
+
+// TAR auto-increment is only promised within a 1K block
+static void ap_incr(SIMAP *ap, u32 bytes) {
+	if ((ap->csw & (3 << 4)) != APCSW_INCR_NONE)
+		ap->tar = (ap->tar & ~0x3FF) | ((ap->tar + bytes) & 0x3FF);
+}
+
+static void ap_xfer(SIMDAP *dap, u32 apnum, u32 addr, int rd, u32 *val) {
+	SIMAP *ap = dap->ap + apnum;
+	int drw = (addr == APACC_DRW);
+	u32 bytes = 4;
+	u32 n, x = 0;
+	if (apnum == 0) {
+		switch (ap->csw & 7) {
+		case APCSW_SIZE8: bytes = 1; break;
+		case APCSW_SIZE16: bytes = 2; break;
+		}
+	}
+	if (!drw) {
+		// banked data: the word at TAR[31:4] + offset
+		addr = (ap->tar & ~0xF) | (addr & 0xC);
+		bytes = 4;
+	} else if ((bytes < 4) && ((ap->csw & (3 << 4)) == APCSW_INCR_PACKED)) {
+		// packed: a transfer per item, each in its own byte lanes
+		// and each moving TAR on, until all four lanes are used
+		for (n = 0; n < 4; n += bytes) {
+			addr = ap->tar & ~(bytes - 1);
+			if (rd)
+				x |= mem_rd(dap, addr, bytes);
+			else
+				mem_wr(dap, addr, bytes, *val);
+			ap_incr(ap, bytes);
+		}
+		if (rd)
+			*val = x;
+		dap->busy = *dap->dev.tck + dap->apwait * (4 / bytes);
+		return;
+	} else {
+		addr = ap->tar & ~(bytes - 1);
+	}
+	if (apnum == 0) {
+		if (rd)
+			*val = mem_rd(dap, addr, bytes);
+		else
+			mem_wr(dap, addr, bytes, *val);
+	} else {
+		if (rd)
+			*val = apb_rd(dap, addr);
+		else
+			apb_wr(dap, addr, *val);
+	}
+	if (drw)
+		ap_incr(ap, bytes);
+	dap->busy = *dap->dev.tck + dap->apwait;
+	if ((apnum == 1) && (((addr & 0xFFC) == DBGDTRTX) ||
+		((addr & 0xFFC) == DBGDTRRX)))
+		dap->busy += dap->dtrwait;
+}
+
+static void ap_access(SIMDAP *dap, u32 addr, int rd, u32 val) {
+	u32 apnum = dap->select >> 24;
+	SIMAP *ap;
+
+	addr |= dap->select & 0xF0;
+	if (!(dap->ctrl & DPCSW_CDBGPWRUPREQ)) {
+		// powered down
+		dap->ctrl |= DPCSW_STICKYERR;
+		dap->rdata = 0;
+		return;
+	}
+	if (apnum > 1) {
+		// no such AP: reads as zero
+		dap->rdata = 0;
+		return;
+	}
+	ap = dap->ap + apnum;
+	switch (addr) {
+	case APACC_CSW:
+		if (rd) {
+			dap->rdata = ap->csw | APCSW_DEVICEEN;
+		} else {
+			ap->csw = val & ~(APCSW_TRBUSY | APCSW_DEVICEEN | APCSW_SPIDEN);
+			if (apnum == 1) {
+				// word accesses only, and no packing
+				ap->csw = (ap->csw & ~7) | APCSW_SIZE32;
+				if ((ap->csw & (3 << 4)) == APCSW_INCR_PACKED)
+					ap->csw &= ~(3 << 4);
+			}
+		}
+		break;
+	case APACC_TAR:
+		if (rd)
+			dap->rdata = ap->tar;
+		else
+			ap->tar = val;
+		break;
+	case APACC_DRW:
+		if ((apnum == 0) && dap->aperr && ((++dap->accesses % dap->aperr) == 0)) {
+			dap->ctrl |= DPCSW_STICKYERR;
+			dap->rdata = 0;
+			break;
+		}
+		// fall through
+	case APACC_BD0:
+	case APACC_BD1:
+	case APACC_BD2:
+	case APACC_BD3:
+		ap_xfer(dap, apnum, addr, rd, &val);
+		if (rd)
+			dap->rdata = val;
+		break;
+	case APACC_CFG:
+		dap->rdata = 0;
+		break;
+	case APACC_BASE:
+		dap->rdata = apnum ? (APB_ROM | 3) : 0xFFFFFFFF;
+		break;
+	case APACC_IDR:
+		dap->rdata = apnum ? APB_AP_IDR : AHB_AP_IDR;
+		break;
+	default:
+		dap->rdata = 0;
+	}
+}
+
+// ---- JTAG-DP ----
+
+static u32 dp_ctrl(SIMDAP *dap) {
+	u32 x = dap->ctrl;
+	if (x & DPCSW_CSYSPWRUPREQ)
+		x |= DPCSW_CSYSPWRUPACK;
+	if (x & DPCSW_CDBGPWRUPREQ)
+		x |= DPCSW_CDBGPWRUPACK;
+	if (x & DPCSW_CDBGRSTREQ)
+		x |= DPCSW_CDBGRSTACK;
+	return x;
+}
+
+static void dp_access(SIMDAP *dap, u32 addr, int rd, u32 val) {
+	switch (addr) {
+	case DPACC_CSW:
+		if (rd) {
+			dap->rdata = dp_ctrl(dap);
+		} else {
+			dap->ctrl &= ~(val & CTRL_STICKY);
+			dap->ctrl = (dap->ctrl & ~CTRL_WRITABLE) | (val & CTRL_WRITABLE);
+		}
+		break;
+	case DPACC_SELECT:
+		if (rd)
+			dap->rdata = dap->select;
+		else
+			dap->select = val;
+		break;
+	case DPACC_RDBUFF:
+		// the result of the last access is returned again
+		break;
+	default:
+		if (rd)
+			dap->rdata = 0;
+	}
+}
+
+static void dap_capture_dr(SIMDEV *dev) {
+	SIMDAP *dap = (void*) dev;
+	switch (dev->ir) {
+	case DAP_IR_ABORT:
+		dev->dr = 0;
+		dev->drlen = 35;
+		break;
+	case DAP_IR_DPACC:
+	case DAP_IR_APACC:
+		dap->waited = (*dev->tck < dap->busy);
+		if (dap->waited) {
+			if (dap->ctrl & DPCSW_ORUNDETECT)
+				dap->ctrl |= DPCSW_STICKYORUN;
+			dev->dr = XPACC_WAIT;
+		} else {
+			dev->dr = (((u64) dap->rdata) << 3) | XPACC_OK;
+		}
+		dev->drlen = 35;
+		break;
+	}
+}
+
+static void dap_update_dr(SIMDEV *dev) {
+	SIMDAP *dap = (void*) dev;
+	u32 addr = (dev->dr << 1) & 0xC;
+	u32 val = dev->dr >> 3;
+	u32 n, mask;
+	int rd = dev->dr & 1;
+
+	switch (dev->ir) {
+	case DAP_IR_ABORT:
+		if (val & 1)
+			dap->busy = 0;
+		break;
+	case DAP_IR_DPACC:
+		if (!dap->waited)
+			dp_access(dap, addr, rd, val);
+		break;
+	case DAP_IR_APACC:
+		if (dap->waited || (dap->ctrl & DPCSW_STICKYORUN))
+			break;
+		if (!rd && ((dap->ctrl & (3 << 2)) == DPCSW_TRNMODE_PUSH_VRFY)) {
+			// pushed verify: read instead, and compare the
+			// byte lanes MASKLANE selects
+			ap_access(dap, addr, 1, 0);
+			for (n = 0, mask = 0; n < 4; n++)
+				if (dap->ctrl & DPCSW_MASKLANE(1 << n))
+					mask |= 0xFF << (8 * n);
+			if ((dap->rdata ^ val) & mask)
+				dap->ctrl |= DPCSW_STICKYCMP;
+		} else {
+			ap_access(dap, addr, rd, val);
+		}
+		break;
+	}
+	dap->waited = 0;
+}
+
+static void dap_close(SIMDEV *dev) {
+	SIMDAP *dap = (void*) dev;
+	u32 n, i;
+	for (n = 0; n < 1024; n++) {
+		if (dap->dir[n] == NULL)
+			continue;
+		for (i = 0; i < 1024; i++)
+			free(dap->dir[n][i]);
+		free(dap->dir[n]);
+	}
+	free(dap);
+}
+
+SIMDEV *sim_dap_create(u32 apwait, u32 aperr, u32 itrwait, u32 dtrwait) {
+	SIMDAP *dap;
+	u32 n, i;
+
+	if ((dap = malloc(sizeof(SIMDAP))) == NULL)
+		return NULL;
+	memset(dap, 0, sizeof(SIMDAP));
+	dap->apwait = apwait;
+	dap->aperr = aperr;
+	dap->dtrwait = dtrwait;
+	for (n = 0; n < 2; n++) {
+		// something recognizable in each cpu, running in svc mode
+		for (i = 0; i < 16; i++)
+			dap->cpu[n].r[i] = ((n + 1) << 28) | i;
+		dap->cpu[n].r[15] = 0x00100000 + n * 0x100;
+		dap->cpu[n].cpsr = 0x000001D3;
+		dap->cpu[n].itrwait = itrwait;
+	}
+	dap->dev.name = "dap";
+	dap->dev.idcode = DAP_IDCODE;
+	dap->dev.irsize = DAP_IR_SIZE;
+	dap->dev.ir_idcode = DAP_IR_IDCODE;
+	dap->dev.capture_dr = dap_capture_dr;
+	dap->dev.update_dr = dap_update_dr;
+	dap->dev.close = dap_close;
+	return &dap->dev;
+}
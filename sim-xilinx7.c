@@ -0,0 +1,237 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jtag-sim.h"
+
+// Simulated Xilinx 7-series TAP.  See: UG470 Xilinx 7 Series FPGAs
+// Configuration.
+//
+// CFG_IN feeds the configuration packet processor, msb first: it
+// hunts bit by bit for the sync word (and realigns on any later one),
+// then takes type 1 and type 2 packets.  Frame data is counted, not
+// kept, and CRCs are not checked.  Register reads queue their results
+// for CFG_OUT.  A START command finishes configuration, setting DONE
+// and friends in STAT.
+//
+// USER4 is the debug register port described in debug.c, with eight
+// registers of plain storage behind it.
+
+#define IR_LEN		6
+#define IR_USER4	0x23
+#define IR_CFG_OUT	0x04
+#define IR_CFG_IN	0x05
+#define IR_IDCODE	0x09
+
+#define CFG_SYNC	0xAA995566
+
+#define CR_FDRI		2
+#define CR_CMD		4
+#define CR_STAT		7
+#define CR_IDCODE	12
+
+#define CMD_START	5
+#define CMD_DESYNC	13
+#define CMD_IPROG	15
+
+#define STAT_ID_ERROR		(1 << 15)
+#define STAT_DONE		(1 << 14)
+#define STAT_RELEASE_DONE	(1 << 13)
+#define STAT_INIT_B		(1 << 12)
+#define STAT_INIT_COMPLETE	(1 << 11)
+#define STAT_GHIGH_B		(1 << 7)
+#define STAT_GWE		(1 << 6)
+#define STAT_GTS_CFG_B		(1 << 5)
+#define STAT_EOS		(1 << 4)
+#define STAT_STATE(n)		(((n) & 7) << 18)
+
+#define STAT_POWERUP	(STAT_INIT_B | STAT_INIT_COMPLETE)
+#define STAT_STARTED	(STAT_POWERUP | STAT_DONE | STAT_RELEASE_DONE | \
+			STAT_GHIGH_B | STAT_GWE | STAT_GTS_CFG_B | STAT_EOS | \
+			STAT_STATE(4))
+
+#define OUT_MAX 256
+
+typedef struct {
+	SIMDEV dev;
+
+	// packet processor
+	u32 synced;
+	u32 word;
+	u32 bits;
+	u32 op;
+	u32 reg;
+	u32 count;
+	u32 stat;
+	u64 frame_words;
+
+	// register reads waiting for CFG_OUT
+	u32 out[OUT_MAX];
+	u32 outhead;
+	u32 outtail;
+	u32 oword;
+	u32 obits;
+
+	// USER4
+	u32 dreg[8];
+	u32 dlast;
+} SIMXC7;
+
+static void out_push(SIMXC7 *x, u32 val) {
+	if ((x->outhead - x->outtail) < OUT_MAX)
+		x->out[(x->outhead++) % OUT_MAX] = val;
+}
+
+static void cfg_write(SIMXC7 *x, u32 reg, u32 val) {
+	switch (reg) {
+	case CR_FDRI:
+		x->frame_words++;
+		break;
+	case CR_CMD:
+		switch (val) {
+		case CMD_START:
+			x->stat = (x->stat & STAT_ID_ERROR) | STAT_STARTED;
+			break;
+		case CMD_DESYNC:
+			x->synced = 0;
+			x->word = 0;
+			break;
+		case CMD_IPROG:
+			x->stat = STAT_POWERUP;
+			break;
+		}
+		break;
+	case CR_IDCODE:
+		if ((val & 0x0FFFFFFF) != (x->dev.idcode & 0x0FFFFFFF))
+			x->stat |= STAT_ID_ERROR;
+		break;
+	}
+}
+
+static void cfg_read(SIMXC7 *x, u32 reg, u32 count) {
+	while (count-- > 0) {
+		switch (reg) {
+		case CR_STAT: out_push(x, x->stat); break;
+		case CR_IDCODE: out_push(x, x->dev.idcode); break;
+		default: out_push(x, 0);
+		}
+	}
+}
+
+static void cfg_word(SIMXC7 *x, u32 word) {
+	if (x->count > 0) {
+		x->count--;
+		if (x->op == 2)
+			cfg_write(x, x->reg, word);
+		return;
+	}
+	switch (word >> 29) {
+	case 1:
+		x->reg = (word >> 13) & 0x1F;
+		x->count = word & 0x7FF;
+		break;
+	case 2:
+		x->count = word & 0x7FFFFFF;
+		break;
+	default:
+		return;
+	}
+	x->op = (word >> 27) & 3;
+	if (x->op == 1) {
+		cfg_read(x, x->reg, (x->count > OUT_MAX) ? OUT_MAX : x->count);
+		x->count = 0;
+	} else if (x->op != 2) {
+		x->count = 0;
+	}
+}
+
+static u32 cfg_in_shift(SIMDEV *dev, u32 tdi) {
+	SIMXC7 *x = (void*) dev;
+	x->word = (x->word << 1) | tdi;
+	if (x->word == CFG_SYNC) {
+		// (re)align, so a bitstream may follow a status read
+		// that was never desynced, whatever junk precedes it
+		x->synced = 1;
+		x->bits = 0;
+		x->count = 0;
+	} else if (x->synced && (++x->bits == 32)) {
+		x->bits = 0;
+		cfg_word(x, x->word);
+	}
+	return 0;
+}
+
+static u32 cfg_out_shift(SIMDEV *dev, u32 tdi) {
+	SIMXC7 *x = (void*) dev;
+	u32 tdo;
+	if (x->obits == 0) {
+		x->oword = (x->outtail != x->outhead) ? x->out[(x->outtail++) % OUT_MAX] : 0;
+		x->obits = 32;
+	}
+	tdo = x->oword >> 31;
+	x->oword <<= 1;
+	x->obits--;
+	return tdo;
+}
+
+static void xc7_capture_dr(SIMDEV *dev) {
+	SIMXC7 *x = (void*) dev;
+	switch (dev->ir) {
+	case IR_CFG_IN:
+		dev->shift = cfg_in_shift;
+		break;
+	case IR_CFG_OUT:
+		x->obits = 0;
+		dev->shift = cfg_out_shift;
+		break;
+	case IR_USER4:
+		dev->dr = x->dlast;
+		dev->drlen = 36;
+		break;
+	}
+}
+
+static void xc7_update_dr(SIMDEV *dev) {
+	SIMXC7 *x = (void*) dev;
+	u32 addr = (dev->dr >> 32) & 7;
+	if (dev->ir != IR_USER4)
+		return;
+	if (dev->dr & (1ULL << 35))
+		x->dreg[addr] = dev->dr;
+	else
+		x->dlast = x->dreg[addr];
+}
+
+static void xc7_close(SIMDEV *dev) {
+	free(dev);
+}
+
+SIMDEV *sim_xilinx7_create(u32 idcode) {
+	SIMXC7 *x;
+	if ((x = malloc(sizeof(SIMXC7))) == NULL)
+		return NULL;
+	memset(x, 0, sizeof(SIMXC7));
+	x->stat = STAT_POWERUP;
+	x->dev.name = "xilinx7";
+	x->dev.idcode = idcode;
+	x->dev.irsize = IR_LEN;
+	x->dev.ir_idcode = IR_IDCODE;
+	x->dev.capture_dr = xc7_capture_dr;
+	x->dev.update_dr = xc7_update_dr;
+	x->dev.close = xc7_close;
+	return &x->dev;
+}
@@ -0,0 +1,117 @@
+// Copyright 2014 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dap.h"
+#include "v7debug.h"
+
+#include "v7debug-registers.h"
+
+// Exercises the DCC paths of v7debug against cpu0 of a Zynq, meant
+// for the simulator, where JTAG_SIM_ITRWAIT moves the completion of
+// each instruction across the batched DSCR and DTR accesses:
+//   for n in 0 8 16 ... 400; do JTAG_SIM=zynq JTAG_SIM_ITRWAIT=$n ./v7debug-test; done
+// Each run goes again with JTAG_SIM_DTRWAIT set, so that DTR accesses
+// WAIT and a batch has to see the one left running through; the
+// registers, as saved on attach, must read the same as the first time.
+
+#define CPU0_BASE	0x80090000
+
+static const char *DTRWAIT[] = { "16", "64", "256" };
+
+static int check(u32 *regs, int first) {
+	JTAG *jtag;
+	DAP *dap;
+	V7DEBUG *debug;
+	u32 save[16], x;
+	unsigned n;
+
+	if (jtag_open(&jtag)) return -1;
+
+	dap = dap_init(jtag, 0x4ba00477);
+	if (dap_attach(dap))
+		goto fail;
+	if ((debug = debug_init(dap, 1, CPU0_BASE)) == NULL)
+		goto fail;
+	if (debug_attach(debug))
+		goto fail;
+
+	for (n = 0; n < 17; n++) {
+		if (debug_reg_rd(debug, n, &x)) goto fail;
+		if (first) {
+			regs[n] = x;
+		} else if (x != regs[n]) {
+			fprintf(stderr, "r%u: read %08x, was %08x\n", n, x, regs[n]);
+			goto fail;
+		}
+	}
+	for (n = 2; n < 15; n++) {
+		if (debug_reg_rd(debug, n, save + n)) goto fail;
+		if (debug_reg_wr(debug, n, 0xC0DE0000 | n)) goto fail;
+	}
+	for (n = 2; n < 15; n++) {
+		if (debug_reg_rd(debug, n, &x)) goto fail;
+		if (x != (0xC0DE0000 | n)) {
+			fprintf(stderr, "r%u: wrote %08x read %08x\n", n, 0xC0DE0000 | n, x);
+			goto fail;
+		}
+		if (debug_reg_wr(debug, n, save[n])) goto fail;
+	}
+	if (debug_detach(debug)) goto fail;
+
+	// with the DCC left full by the program, a register write
+	// must fail, not load the stale value
+	if (dap_mem_wr32(dap, 1, CPU0_BASE + DBGDTRRX, 0xBAD0BAD0)) goto fail;
+	if (debug_attach(debug)) goto fail;
+	if (debug_reg_wr(debug, 5, 0x55555555) == 0) {
+		fprintf(stderr, "write with the dcc full succeeded\n");
+		goto fail;
+	}
+	if (debug_reg_rd(debug, 5, &x)) goto fail;
+	if (x != save[5]) {
+		fprintf(stderr, "r5: was %08x now %08x\n", save[5], x);
+		goto fail;
+	}
+	jtag_close(jtag);
+	return 0;
+
+fail:
+	jtag_close(jtag);
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	u32 regs[17];
+	unsigned n;
+
+	if (check(regs, 1)) goto fail;
+	if (getenv("JTAG_SIM") && !getenv("JTAG_SIM_DTRWAIT")) {
+		for (n = 0; n < sizeof(DTRWAIT) / sizeof(DTRWAIT[0]); n++) {
+			setenv("JTAG_SIM_DTRWAIT", DTRWAIT[n], 1);
+			if (check(regs, 0)) {
+				fprintf(stderr, "with JTAG_SIM_DTRWAIT=%s\n", DTRWAIT[n]);
+				goto fail;
+			}
+		}
+	}
+	printf("v7debug ok\n");
+	return 0;
+
+fail:
+	printf("v7debug FAILED\n");
+	return -1;
+}
@@ -62,6 +62,9 @@ struct V7DEBUG {
 
 	// cached cpsr
 	u32 cpsr;
+
+	// DTRRX seen empty since our last write, while halted
+	u32 rx_empty;
 };
 
 static inline int dwr(V7DEBUG *debug, u32 off, u32 val) {
@@ -72,6 +75,15 @@ static inline int drd(V7DEBUG *debug, u32 off, u32 *val) {
 	return dap_mem_rd32(debug->dap, debug->apnum, debug->base + off, val);
 }
 
+// add a debug register access to a batch
+static inline DAPOP *dop(V7DEBUG *debug, DAPOP *op, u32 off, u32 write, u32 val) {
+	op->apnum = debug->apnum;
+	op->addr = debug->base + off;
+	op->write = write;
+	op->val = val;
+	return op + 1;
+}
+
 V7DEBUG *debug_init(DAP *dap, u32 apnum, u32 base) {
 	V7DEBUG *debug = malloc(sizeof(V7DEBUG));
 	if (debug == NULL) {
@@ -97,29 +109,83 @@ static int dccrd(V7DEBUG *debug, u32 *val) {
 	return -1;
 }
 
-static int dccwr(V7DEBUG *debug, u32 val) {
-	u32 x;
+// poll DSCR, starting from the value in *x, until the last
+// instruction has completed
+static int dwait(V7DEBUG *debug, u32 *x) {
 	int n;
-	for (n = 0; n < 10; n++) {
-		if (drd(debug, DBGDSCR, &x)) return -1;
-		if (!(x & DSCR_RXFULL)) {
-			return dwr(debug, DBGDTRRX, val);
+	for (n = 0; !(*x & DSCR_INSTRCOMPL); n++) {
+		if (n == 10) {
+			fprintf(stderr, "v7debug: instruction timed out\n");
+			return -1;
 		}
+		if (drd(debug, DBGDSCR, x)) return -1;
 	}
-	fprintf(stderr, "v7debug: dcc write timed out\n");
-	return -1;
+	return 0;
 }
 
 static int dexec(V7DEBUG *debug, u32 instr) {
+	DAPOP op[2], *p = op;
+	// the instruction has nearly always completed by the time the
+	// DSCR read behind it in the same batch gets there
+	p = dop(debug, p, DBGITR, 1, instr);
+	p = dop(debug, p, DBGDSCR, 0, 0);
+	if (dap_mem_batch(debug->dap, op, p - op)) return -1;
+	return dwait(debug, &op[1].val);
+}
+
+// Execute an instruction that writes the DCC, and read it, in one
+// batch.  Should the first DSCR read find it not yet done, the DTRTX
+// read behind it got nothing, unless the instruction finished in
+// between, in which case that read took the value: the second DSCR
+// read tells which, by finding it done and the DCC already drained.
+static int dexec_dccrd(V7DEBUG *debug, u32 instr, u32 *val) {
+	DAPOP op[4], *p = op;
+	u32 x;
+	p = dop(debug, p, DBGITR, 1, instr);
+	p = dop(debug, p, DBGDSCR, 0, 0);
+	p = dop(debug, p, DBGDTRTX, 0, 0);
+	p = dop(debug, p, DBGDSCR, 0, 0);
+	if (dap_mem_batch(debug->dap, op, p - op)) return -1;
+	if ((op[1].val & (DSCR_INSTRCOMPL | DSCR_TXFULL)) ==
+		(DSCR_INSTRCOMPL | DSCR_TXFULL)) {
+		*val = op[2].val;
+		return 0;
+	}
+	x = op[3].val;
+	if (!(op[1].val & DSCR_INSTRCOMPL) &&
+		((x & (DSCR_INSTRCOMPL | DSCR_TXFULL)) == DSCR_INSTRCOMPL)) {
+		*val = op[2].val;
+		return 0;
+	}
+	// still running, or done with the value still in the DCC
+	if (dwait(debug, &x)) return -1;
+	return dccrd(debug, val);
+}
+
+// Put a value in the DCC and execute an instruction that reads it, in
+// one batch.  A write to a full DTRRX is dropped while the instruction
+// still runs, so unless it was seen drained after the last write, poll
+// for that first.
+static int dccwr_dexec(V7DEBUG *debug, u32 val, u32 instr) {
+	DAPOP op[3], *p = op;
 	u32 x;
 	int n;
-	dwr(debug, DBGITR, instr);
-	for (n = 0; n < 10; n++) {
+	for (n = 0; !debug->rx_empty; n++) {
+		if (n == 10) {
+			fprintf(stderr, "v7debug: dcc write timed out\n");
+			return -1;
+		}
 		if (drd(debug, DBGDSCR, &x)) return -1;
-		if (x & DSCR_INSTRCOMPL) return 0;
+		debug->rx_empty = !(x & DSCR_RXFULL);
 	}
-	fprintf(stderr, "v7debug: instruction timed out\n");
-	return -1;
+	p = dop(debug, p, DBGDTRRX, 1, val);
+	p = dop(debug, p, DBGITR, 1, instr);
+	p = dop(debug, p, DBGDSCR, 0, 0);
+	debug->rx_empty = 0;
+	if (dap_mem_batch(debug->dap, op, p - op)) return -1;
+	if (dwait(debug, &op[2].val)) return -1;
+	debug->rx_empty = !(op[2].val & DSCR_RXFULL);
+	return 0;
 }
 
 #define ARM_DSB			0xEE070F9A
@@ -146,8 +212,7 @@ int debug_reg_rd(V7DEBUG *debug, unsigned n, u32 *val) {
 	if (n > 15) {
 		return -1;
 	}
-	if (dexec(debug, ARM_MOV_DCC_Rx(n))) return -1;
-	return dccrd(debug, val);
+	return dexec_dccrd(debug, ARM_MOV_DCC_Rx(n), val);
 }
 
 int debug_reg_wr(V7DEBUG *debug, unsigned n, u32 val) {
@@ -163,11 +228,11 @@ int debug_reg_wr(V7DEBUG *debug, unsigned n, u32 val) {
 	if (n > 15) {
 		return -1;
 	}
-	if (dccwr(debug, val)) return -1;
-	return dexec(debug, ARM_MOV_Rx_DCC(n));
+	return dccwr_dexec(debug, val, ARM_MOV_Rx_DCC(n));
 }
 
 int debug_attach(V7DEBUG *debug) {
+	DAPOP op[4], *p = op;
 	u32 x;
 	int n;
 
@@ -175,39 +240,38 @@ int debug_attach(V7DEBUG *debug) {
 		return -1;
 	}
 
-	drd(debug, DBGDSCR, &x);
-	if (x & DSCR_HALTED) {
+	p = dop(debug, p, DBGDSCR, 0, 0);
+	p = dop(debug, p, DBGDSCR, 1, DSCR_H_DBG_EN | DSCR_RESTARTED | DSCR_HALTED);
+	p = dop(debug, p, DBGDRCR, 1, DRCR_HALT_REQ);
+	p = dop(debug, p, DBGDSCR, 0, 0);
+	if (dap_mem_batch(debug->dap, op, p - op)) return -1;
+	if (op[0].val & DSCR_HALTED) {
 		fprintf(stderr, "debug: warning, processor already halted\n");
 	}
-		
-	dwr(debug, DBGDSCR, DSCR_H_DBG_EN | DSCR_RESTARTED | DSCR_HALTED);
-
-	dwr(debug, DBGDRCR, DRCR_HALT_REQ);
+	x = op[3].val;
 	for (n = 0; n < 100; n++) {
-		if (drd(debug, DBGDSCR, &x)) return -1;
 		if (x & DSCR_HALTED) goto halted;
+		if (drd(debug, DBGDSCR, &x)) return -1;
 	}
 	fprintf(stderr, "v7debug: halt timed out\n");
 	return -1;
 
 halted:
 	dwr(debug, DBGDSCR, DSCR_H_DBG_EN | DSCR_ITR_EN | DSCR_RESTARTED | DSCR_HALTED);
+	// the DCC was the program's while it ran
+	debug->rx_empty = 0;
 
 	// save essential state
 	// we need r0/r1 to shuffle data in/out of memory and dcc
 	// pc will be corrupted on cpsr writes
 	// cpsr needs to be written to access other modes
 	dexec(debug, ARM_DSB);
-	dexec(debug, ARM_MOV_DCC_Rx(0));
-	dccrd(debug, &debug->save_r0);
-	dexec(debug, ARM_MOV_DCC_Rx(1));
-	dccrd(debug, &debug->save_r1);
+	dexec_dccrd(debug, ARM_MOV_DCC_Rx(0), &debug->save_r0);
+	dexec_dccrd(debug, ARM_MOV_DCC_Rx(1), &debug->save_r1);
 	dexec(debug, ARM_MOV_R0_PC);
-	dexec(debug, ARM_MOV_DCC_Rx(0));
-	dccrd(debug, &debug->save_pc);
+	dexec_dccrd(debug, ARM_MOV_DCC_Rx(0), &debug->save_pc);
 	dexec(debug, ARM_MOV_R0_CPSR);
-	dexec(debug, ARM_MOV_DCC_Rx(0));
-	dccrd(debug, &debug->save_cpsr);
+	dexec_dccrd(debug, ARM_MOV_DCC_Rx(0), &debug->save_cpsr);
 	if (debug->save_cpsr & ARM_T) {
 		debug->save_pc -= 4;
 	} else {
@@ -219,30 +283,28 @@ halted:
 }
 
 int debug_detach(V7DEBUG *debug) {
+	DAPOP op[3], *p = op;
+
 	if (debug->state != STATE_HALTED) {
 		return -1;
 	}
 
-	dccwr(debug, debug->save_cpsr);
-	dexec(debug, ARM_MOV_Rx_DCC(0));
+	dccwr_dexec(debug, debug->save_cpsr, ARM_MOV_Rx_DCC(0));
 	dexec(debug, ARM_MOV_CPSR_R0);
 
-	dccwr(debug, debug->save_pc);
-	dexec(debug, ARM_MOV_Rx_DCC(0));
+	dccwr_dexec(debug, debug->save_pc, ARM_MOV_Rx_DCC(0));
 	dexec(debug, ARM_MOV_PC_R0);
 
-	dccwr(debug, debug->save_r0);
-	dexec(debug, ARM_MOV_Rx_DCC(0));
-
-	dccwr(debug, debug->save_r1);
-	dexec(debug, ARM_MOV_Rx_DCC(1));
+	dccwr_dexec(debug, debug->save_r0, ARM_MOV_Rx_DCC(0));
+	dccwr_dexec(debug, debug->save_r1, ARM_MOV_Rx_DCC(1));
 
 	dexec(debug, ARM_ICIALLU);
 	dexec(debug, ARM_ISB);
 
-	dwr(debug, DBGDSCR, 0);
-	dwr(debug, DBGDRCR, DRCR_CLR_EXC);
-	dwr(debug, DBGDRCR, DRCR_START_REQ);
+	p = dop(debug, p, DBGDSCR, 1, 0);
+	p = dop(debug, p, DBGDRCR, 1, DRCR_CLR_EXC);
+	p = dop(debug, p, DBGDRCR, 1, DRCR_START_REQ);
+	dap_mem_batch(debug->dap, op, p - op);
 
 	debug->state = STATE_RUNNING;
 	return 0;
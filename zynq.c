@@ -21,11 +21,6 @@
 
 #include "v7debug.h"
 
-#define ZYNQ_DEBUG0_APN		1
-#define ZYNQ_DEBUG0_BASE	0x80090000
-#define ZYNQ_DEBUG1_APN		1
-#define ZYNQ_DEBUG1_BASE	0x80092000
-
 void *loadfile(const char *fn, u32 *sz) {
 	int fd;
 	off_t end;
@@ -51,11 +46,25 @@ int usage(void) {
 "zynq regs                     pause both cpus, dump registers, resume\n"
 "zynq reset                    reset the SoC\n"
 "zynq fpga <bitfile>           reset fpga and download bitfile to it\n"
+"zynq speed [maxkhz]           find the fastest reliable TCK for this board\n"
 "\n"
 		);
 	return -1;
 }
 
+// on-chip memory, through the AHB-AP, where it is after reset
+#define ZYNQ_OCM	0x00000000
+
+// The debug unit of cpu n, wherever the ROM tables put it
+static V7DEBUG *zynq_debug_init(DAP *dap, u32 n) {
+	u32 apnum, base;
+	if (dap_find_component(dap, CS_CORTEX_A9_DEBUG, n, &apnum, &base)) {
+		fprintf(stderr, "error: cannot find debug unit of cpu%u\n", n);
+		return NULL;
+	}
+	return debug_init(dap, apnum, base);
+}
+
 int fpga_send_bitfile(JTAG *jtag, void *data, u32 sz, int warmboot);
 int fpga_prepare_bitfile(u8 *data, u32 sz);
 
@@ -64,6 +73,7 @@ int main(int argc, char **argv) {
 	DAP *dap;
 	V7DEBUG *d0;
 	V7DEBUG *d1;
+	DAP_STATS ds;
 	void *data;
 	u32 sz;
 
@@ -71,10 +81,20 @@ int main(int argc, char **argv) {
 		return usage();
 	}
 
-	if (jtag_mpsse_open(&jtag)) return -1;
+	if (jtag_open(&jtag)) return -1;
 	jtag_enumerate(jtag);
 	jtag_print_chain(jtag);
 
+	if (!strcmp(argv[1], "speed")) {
+		if (argc > 3) {
+			return usage();
+		}
+		if (jtag_calibrate(jtag, (argc == 3) ? strtoul(argv[2], 0, 0) : 30000) < 0) {
+			return -1;
+		}
+		return 0;
+	}
+
 	if (!strcmp(argv[1], "fpga")) {
 		if (argc != 3) {
 			return usage();
@@ -84,13 +104,18 @@ int main(int argc, char **argv) {
 			return -1;
 		}
 		fpga_prepare_bitfile(data, sz);
-		return fpga_send_bitfile(jtag, data, sz, 0);
+		if (fpga_send_bitfile(jtag, data, sz, 0)) {
+			return -1;
+		}
+		jtag_close(jtag);
+		return 0;
 	}
 
 	if ((dap = dap_init(jtag, 0x4ba00477)) == NULL) return -1;
 	if (dap_attach(dap)) return -1;
-	if ((d0 = debug_init(dap, ZYNQ_DEBUG0_APN, ZYNQ_DEBUG0_BASE)) == NULL) return -1;
-	if ((d1 = debug_init(dap, ZYNQ_DEBUG1_APN, ZYNQ_DEBUG1_BASE)) == NULL) return -1;
+	dap_calibrate(dap, 0, ZYNQ_OCM);
+	if ((d0 = zynq_debug_init(dap, 0)) == NULL) return -1;
+	if ((d1 = zynq_debug_init(dap, 1)) == NULL) return -1;
 
 	if (!strcmp(argv[1], "run")) {
 		if (argc != 3) {
@@ -105,20 +130,38 @@ int main(int argc, char **argv) {
 			return -1;
 		}
 		if (debug_attach(d0)) return -1;
-		dap_mem_write(dap, 0, 0, data, sz);
-		debug_reg_wr(d0, 15, 0);
-		debug_detach(d0);
+		if (dap_mem_write(dap, 0, 0, data, sz) ||
+			dap_mem_verify(dap, 0, 0, data, sz)) {
+			fprintf(stderr, "error: could not download image\n");
+			return -1;
+		}
+		dap_get_stats(dap, &ds);
+		if (ds.retries) {
+			fprintf(stderr, "zynq: %llu retries, %llu recoveries\n",
+				(unsigned long long) ds.retries,
+				(unsigned long long) ds.recoveries);
+		}
+		if (debug_reg_wr(d0, 15, 0) || debug_detach(d0)) {
+			fprintf(stderr, "error: could not resume cpu0\n");
+			return -1;
+		}
 	} else if (!strcmp(argv[1], "regs")) {
-		debug_attach(d0);
-		debug_attach(d1);
+		if (debug_attach(d0)) return -1;
+		if (debug_attach(d1)) {
+			debug_detach(d0);
+			return -1;
+		}
 		printf("CPU0:\n");
 		debug_reg_dump(d0);
 		printf("\nCPU1:\n");
 		debug_reg_dump(d1);
-		debug_detach(d0);
-		debug_detach(d1);
+		if (debug_detach(d0) | debug_detach(d1)) return -1;
 	} else if (!strcmp(argv[1], "reset")) {
-		dap_mem_wr32(dap, 0, 0xF8000008, 0xDF0D);
+		// unlock the SLCR, then reset; that write may not complete
+		if (dap_mem_wr32(dap, 0, 0xF8000008, 0xDF0D)) {
+			fprintf(stderr, "error: cannot unlock slcr\n");
+			return -1;
+		}
 		dap_mem_wr32(dap, 0, 0xF8000200, 1);
 	} else {
 		return usage();